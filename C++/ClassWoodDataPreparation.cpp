@@ -8,11 +8,31 @@
 // Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
 // All Rights Reserved
 
+// Keep windows.h from defining the min and max macros, that break std::min and std::max.
+#define NOMINMAX
 #include <windows.h>
 #include <mil.h>
 #include <string>
 #include <random>
 #include <numeric>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <regex>
+#include <unordered_set>
+#include <bitset>
+#include <cmath>
+#include "DataPrepConfig.h"
+#include "Utilities.h"
+#include "RasterImage.h"
+#include "ImageSources.h"
+#include "LabelIndex.h"
+#include "EntryTable.h"
+#include "TileWriter.h"
 
 // ===========================================================================
 // Example description.
@@ -37,54 +57,134 @@ void PrintHeader()
    MosGetch();
    }
 
-// Path definitions.
-#define IMAGE_ROOT_PATH M_IMAGE_PATH MIL_TEXT("/Classification/ClassWoodDataPreparation/")
-#define EXAMPLE_IMAGE_PATH           IMAGE_ROOT_PATH MIL_TEXT("Data/Images/")
-#define EXAMPLE_LABEL_PATH           IMAGE_ROOT_PATH MIL_TEXT("Data/Labels/")
-#define EXAMPLE_DEST_DATA_PATH       MIL_TEXT("Dest\\")
+// ===========================================================================
+// Run-time parameters.
+// ===========================================================================
 
-// First crop larger tiles to have data during augmentaiton for overscan. 
-static const MIL_INT NO_AUG_IMAGE_SIZE = 140;
+MIL_INT LabelValueToClassIndex(const SDataPrepConfig& Config, MIL_DOUBLE LabelValue);
 
-// Size of the tiles that will be used for training. 
-static const MIL_INT TILE_IMAGE_SIZE = 115;
+// ===========================================================================
+// Source images.
+// ===========================================================================
 
-// Define the retina size.
-// Label each tile using a smaller retina inside the tile.
-// The larger the size of retina, the coarser the result of segmentation.
-// The size come as percentage of Width and Height of the tile.
-static const MIL_INT LABEL_RETINA_SIZE = 16;
+// Times the tile copies of CopyRasterTile against MbufCopyColor2d on a source
+// image, and checks that they give the same tiles.
+void BenchmarkTileCopy(MIL_ID MilSystem, CImageSource& Source, const MIL_STRING& FileName, MIL_INT TileSize, unsigned int Seed);
 
-// How many tiles to extract randomly from each image.
-static const MIL_INT NB_RAND_TILES_PER_IMAGE = 15;
+// ===========================================================================
+// Dataset entry table.
+// ===========================================================================
 
-// Define the classes.
-static const MIL_INT NUMBER_OF_CLASSES = 3;
-MIL_STRING CLASS_NAMES[NUMBER_OF_CLASSES] = {MIL_TEXT("NoDefect"),
-                                             MIL_TEXT("LargeKnots"),
-                                             MIL_TEXT("SmallKnots")};
+// Augmentation of the tiles, shared by the augmentation stage, that reloads
+// the saved tiles, and by the extraction stages when the tiles are augmented
+// while they are still in memory (DirectCrop). The augmented images are saved
+// through their centered FinalImageSize child, so they never go through the
+// crop stage.
+class CTileAugmenter
+   {
+   public:
+      CTileAugmenter(MIL_ID System, const MIL_INT* NbAugmentPerImage, MIL_INT FinalImageSize, unsigned int Seed, CTileWriter& Writer);
+
+      // Augments the image of an entry as many times as required by its class,
+      // saves the augmented images next to it and appends them to the entries.
+      void AugmentTile(MIL_ID TileImage, MIL_INT SourceEntry, CEntryTable& Entries);
+
+   private:
+      MIL_ID            m_System;
+      const MIL_INT*    m_NbAugmentPerImage;
+      MIL_INT           m_FinalImageSize;
+      unsigned int      m_Seed;
+      CTileWriter&      m_Writer;
+      MIL_UNIQUE_IM_ID  m_AugmentContext;
+      MIL_UNIQUE_BUF_ID m_AugmentedImage;
+      MIL_UNIQUE_BUF_ID m_AugmentedCrop;    // Child of m_AugmentedImage.
+      MIL_INT           m_AugmentedCropSize = 0;
+      CTilePathBuilder  m_PathBuilder;
+   };
+
+// Perceptual hashes of the extracted tiles, to drop the tiles that nearly
+// duplicate a tile already kept, e.g. a random tile that lands on a knot also
+// extracted at its CoG. The hash is the average hash of the tile reduced to
+// 8x8. It is split in MaxDistance + 1 bands, so that two hashes within
+// MaxDistance bits share at least one band, and a tile is only compared with
+// the tiles of the same source image that share one of its bands (LSH).
+class CTileHashIndex
+   {
+   public:
+      CTileHashIndex(MIL_ID System, MIL_INT MaxDistance);
+
+      // Adds the tile to the index and returns true, unless it nearly
+      // duplicates an overlapping tile of the same source image and class.
+      // Tiles of different classes are all kept, even when their hashes are
+      // close: they differ by their label, e.g. a knot at the center of one
+      // tile and at the border of the other, which the hash does not see.
+      bool AddTile(MIL_ID TileImage, MIL_INT SourceIndex, MIL_INT ClassIndex, MIL_INT OffsetX, MIL_INT OffsetY);
 
-// Icon image for each class.
-MIL_STRING CLASS_ICONS[NUMBER_OF_CLASSES] = {IMAGE_ROOT_PATH MIL_TEXT("Data\\NoDefect.mim"),
-                                             IMAGE_ROOT_PATH MIL_TEXT("Data\\LargeKnots.mim"),
-                                             IMAGE_ROOT_PATH MIL_TEXT("Data\\SmallKnots.mim")};
+      MIL_INT NumberOfDropped() const { return m_NbDropped; }
 
-// Define the associated value of each class in the label image.
-MIL_INT CLASS_LABEL_VALUES[NUMBER_OF_CLASSES] = {0,1,2};
+      // Bit i is set when pixel i of the 8x8 thumbnail, summed over its bands, is above the mean.
+      static MIL_UINT64 ComputeAverageHash(const MIL_UINT8* Thumbnail, MIL_INT NbBands);
+
+   private:
+      struct SIndexedTile
+         {
+         MIL_UINT64 Hash;
+         MIL_INT32  SourceIndex;
+         MIL_INT32  ClassIndex;
+         MIL_INT32  OffsetX;
+         MIL_INT32  OffsetY;
+         MIL_INT32  SizeX;
+         MIL_INT32  SizeY;
+         };
 
-// How many times to perform augmentation on the tiles of each class.
-// Augmentation can help to balance the dataset. 
-MIL_INT NB_AUGMENTATION_PER_IMAGE[NUMBER_OF_CLASSES] = {1, 9, 9};
+      MIL_UINT64 BucketKey(MIL_INT SourceIndex, MIL_INT BandIndex, MIL_UINT64 Hash) const;
+
+      MIL_ID                                                   m_System;
+      MIL_INT                                                  m_MaxDistance;
+      MIL_INT                                                  m_NbBands;
+      MIL_UNIQUE_BUF_ID                                        m_Thumbnail;
+      std::vector<MIL_UINT8>                                   m_ThumbnailPixels;
+      std::vector<SIndexedTile>                                m_Tiles;
+      std::unordered_map<MIL_UINT64, std::vector<MIL_UINT32>> m_Buckets;
+      MIL_INT                                                  m_NbDropped = 0;
+   };
+
+MIL_STRING GetShardDatasetFile(const MIL_STRING& DatasetFile, MIL_INT ShardIndex, MIL_INT ShardCount);
+
+void GetListingIndices(MIL_ID ListingDataset, std::map<MIL_STRING, MIL_INT>& ListingIndices);
+
+void SelectShardEntries(const CEntryTable& SourceImages, MIL_INT ShardIndex, MIL_INT ShardCount, CEntryTable& ShardImages);
+
+bool IsTrainSourceImage(const MIL_STRING& FileName, MIL_DOUBLE PercentageInTrain, unsigned int Seed);
+
+MIL_INT GetSourceImageShard(const MIL_STRING& FileName, MIL_INT ShardCount, unsigned int Seed);
+
+void SplitSourceImagesByHash(const std::vector<MIL_STRING>& SourceImages,
+                             const std::vector<MIL_STRING>& SplitKeys,
+                             const SDataPrepConfig& Config,
+                             CEntryTable& TrainImages,
+                             CEntryTable& DevImages);
+
+MIL_INT GetSourceImageGroups(CImageSource& Source,
+                             const std::vector<MIL_STRING>& SourceImages,
+                             const MIL_STRING& GroupPattern,
+                             std::vector<MIL_STRING>& Groups);
+
+bool MergeShardDatasets(MIL_ID MilSystem, const SDataPrepConfig& Config);
 
 MIL_STRING GetExampleCurrentDirectory();
 
 const std::vector<MIL_INT> CreateShuffledIndex(MIL_INT NbEntries, unsigned int Seed);
 
-void DeleteFiles(const std::vector<MIL_STRING>& Files);
+MIL_INT DeleteFiles(const CDirectoryListing& Files);
+
+void DeleteFilesInFolder(const MIL_STRING& FolderName);
 
-void ListFilesInFolder(const MIL_ID MilApplication, const MIL_STRING& FolderName, std::vector<MIL_STRING>& FilesInFolder);
+MIL_INT DeleteFolderTree(const MIL_STRING& FolderName);
 
-void DeleteFilesInFolder(const MIL_ID MilApplication, const MIL_STRING& FolderName);
+bool MoveFolderAside(const MIL_STRING& FolderName, MIL_STRING& AsideFolderName);
+
+bool CollectOldFolders(const MIL_STRING& FolderName);
 
 void AddClassDefinitions(MIL_ID MilSystem,
                          MIL_ID Dataset,
@@ -92,37 +192,119 @@ void AddClassDefinitions(MIL_ID MilSystem,
                          const MIL_STRING* ClassIcons,
                          MIL_INT NumberOfClasses);
 
+// Checks that a source image is larger than the tiles by at least MinMargin
+// pixels in both directions, the tile size being a run-time parameter.
+// Otherwise, the image is reported and should be skipped.
+bool CheckTileFits(const MIL_STRING& FileName, MIL_INT ImageSizeX, MIL_INT ImageSizeY, MIL_INT TileSizeX, MIL_INT TileSizeY, MIL_INT MinMargin);
+
+// Positions kept at a minimum distance from each other (Poisson-disk). The
+// cells of the grid are small enough to hold a single position, so a new
+// position is only compared with the positions of the 5x5 cells around it.
+// Only the occupied cells are stored, so the memory follows the number of
+// positions rather than the area of the image.
+class CSpacedPositions
+   {
+   public:
+      void Reset(MIL_DOUBLE MinDistance);
+
+      // Adds the position and returns true if no position is closer than the minimum distance.
+      bool TryAdd(MIL_INT X, MIL_INT Y);
+
+   private:
+      static MIL_UINT64 CellKey(MIL_INT CellX, MIL_INT CellY) { return ((MIL_UINT64)CellY << 32) | (MIL_UINT32)CellX; }
+
+      MIL_DOUBLE             m_MinDistance2 = 0.0;
+      MIL_DOUBLE             m_CellSize = 1.0;
+      std::unordered_map<MIL_UINT64, MIL_INT32> m_Cells;   // Index of the position in each occupied cell.
+      std::vector<MIL_INT32> m_PositionsX;
+      std::vector<MIL_INT32> m_PositionsY;
+   };
+
+// A tile whose position and class are known from the label index, waiting for
+// the band of the source image that holds it to be read.
+struct STileToExtract
+   {
+   MIL_INT ClassIndex;
+   MIL_INT OffsetX;
+   MIL_INT OffsetY;
+   MIL_INT NameIndex0;
+   MIL_INT NameIndex1;
+   };
+
+// Cuts the tiles from the source image band by band, each band being read
+// with the tile height of overlap so that every tile lies within its band.
+void ExtractTilesByBand(CImageBandReader& Image,
+                        MIL_INT SourceIndex,
+                        std::vector<STileToExtract>& Tiles,
+                        const MIL_TEXT_CHAR* Tag,
+                        bool ClearTile,
+                        MIL_ID TileImage,
+                        CTilePathBuilder& PathBuilder,
+                        const SDataPrepConfig& Config,
+                        CTileHashIndex* TileHashes,
+                        CTileAugmenter* Augmenter,
+                        CTileWriter& Writer,
+                        CEntryTable& DestEntries);
+
 void ExtractRandomTiles(MIL_ID MilSystem,
-                        MIL_ID SourceDataset,
+                        CImageSource& Source,
+                        const CEntryTable& SourceImages,
                         MIL_INT NbTiles,
                         MIL_INT SizeX,
                         MIL_INT SizeY,
-                        MIL_STRING ImagesPath,
-                        MIL_STRING LabelsPath,
-                        MIL_STRING DestPath,
-                        MIL_STRING* ClassNames,
-                        MIL_ID DestDataset);
+                        const SDataPrepConfig& Config,
+                        CTileHashIndex* TileHashes,
+                        CTileAugmenter* Augmenter,
+                        CTileWriter& Writer,
+                        CEntryTable& DestEntries);
 
 void ExtractCoGTiles(MIL_ID MilSystem,
-                     MIL_ID SourceDataset,
-                     MIL_INT NbClasses,
+                     CImageSource& Source,
+                     const CEntryTable& SourceImages,
                      MIL_INT SizeX,
                      MIL_INT SizeY,
-                     MIL_STRING ImagesPath,
-                     MIL_STRING LabelsPath,
-                     MIL_STRING DestPath,
-                     MIL_STRING* ClassNames,
-                     MIL_ID DestDataset);
-
-void PrepareExampleDataFolder(const MIL_ID MilApplication, const MIL_STRING& ExampleDataPath, const MIL_STRING* ClassName, MIL_INT NumberOfClasses);
-
-void AddFolderToDataset(const MIL_ID MilApplication, const MIL_STRING& DataPath, MIL_ID Dataset);
-
-void AugmentDataset(MIL_ID System, MIL_ID Dataset, const MIL_INT* NbAugmentPerImage);
-
-void CropDatasetImages(MIL_ID MilSystem, MIL_ID Dataset, MIL_INT FinalImageSize);
-
-MIL_DOUBLE GetRetinaLabel(MIL_ID MilSystem, MIL_ID LabelImage, MIL_INT RetinaSizeX, MIL_INT RetinaSizeY);
+                     const SDataPrepConfig& Config,
+                     CTileHashIndex* TileHashes,
+                     CTileAugmenter* Augmenter,
+                     CTileWriter& Writer,
+                     CEntryTable& DestEntries);
+
+void PrepareExampleDataFolder(const MIL_STRING& ExampleDataPath, const MIL_STRING* ClassName, MIL_INT NumberOfClasses, MIL_INT FanOut, bool DeleteExistingFiles);
+
+void AddSourceToDataset(CImageSource& Source, MIL_ID Dataset);
+
+void SaveExtractedTile(MIL_ID TileImage,
+                       const MIL_STRING& TileFileName,
+                       MIL_INT ClassIndex,
+                       MIL_INT SourceIndex,
+                       MIL_INT OffsetX,
+                       MIL_INT OffsetY,
+                       const SDataPrepConfig& Config,
+                       CTileAugmenter* Augmenter,
+                       CTileWriter& Writer,
+                       CEntryTable& DestEntries);
+
+void AugmentDataset(MIL_ID System, CEntryTable& Entries, const MIL_INT* NbAugmentPerImage, MIL_INT FinalImageSize, unsigned int Seed, CTileWriter& Writer);
+
+void CropDatasetImages(MIL_ID MilSystem, const CEntryTable& Entries, MIL_INT FinalImageSize, CTileWriter& Writer);
+
+MIL_DOUBLE GetRetinaLabel(const CLabelBlockIndex& LabelIndex,
+                          MIL_INT TileOffsetX,
+                          MIL_INT TileOffsetY,
+                          MIL_INT TileSizeX,
+                          MIL_INT TileSizeY,
+                          MIL_INT RetinaSizeX,
+                          MIL_INT RetinaSizeY);
+
+MIL_INT GetRetinaClass(const CLabelBlockIndex& LabelIndex,
+                       MIL_INT TileOffsetX,
+                       MIL_INT TileOffsetY,
+                       MIL_INT TileSizeX,
+                       MIL_INT TileSizeY,
+                       MIL_INT RetinaSizeX,
+                       MIL_INT RetinaSizeY,
+                       const SDataPrepConfig& Config,
+                       std::vector<MIL_INT>& ClassCounts);
 
 MIL_UNIQUE_BUF_ID CreateImageOfAllClasses(MIL_ID MilSystem,
                                           const MIL_STRING* ClassIcons,
@@ -133,27 +315,89 @@ MIL_UNIQUE_BUF_ID CreateImageOfAllClasses(MIL_ID MilSystem,
 // ****************************************************************************
 //    Main.
 // ****************************************************************************
-int MosMain()
+int MosMain(int argc, MIL_TEXT_CHAR* argv[])
    {
-   PrintHeader();
+   // Load the run-time parameters.
+   SDataPrepConfig Config;
+   if(!LoadConfig(argc, argv, Config))
+      {
+      PrintUsage();
+      return 1;
+      }
+
+   if(Config.Interactive)
+      PrintHeader();
+
+   PrintConfig(Config);
 
    MIL_UNIQUE_APP_ID MilApplication = MappAlloc(M_NULL, M_DEFAULT, M_UNIQUE_ID);
    MIL_UNIQUE_SYS_ID MilSystem = MsysAlloc(M_DEFAULT, M_SYSTEM_HOST, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
 
    // Display sample tiles.
-   MIL_UNIQUE_DISP_ID MilDisplay = MdispAlloc(MilSystem, M_DEFAULT, MIL_TEXT("M_DEFAULT"), M_DEFAULT, M_UNIQUE_ID);
+   MIL_UNIQUE_DISP_ID MilDisplay;
+   MIL_UNIQUE_BUF_ID AllClassesImage;
+   if(Config.Interactive && !Config.ClassIcons.empty())
+      {
+      MilDisplay = MdispAlloc(MilSystem, M_DEFAULT, MIL_TEXT("M_DEFAULT"), M_DEFAULT, M_UNIQUE_ID);
+
+      // Display a representative image of all classes.
+      AllClassesImage = CreateImageOfAllClasses(MilSystem, Config.ClassIcons.data(), Config.ClassNames.data(), Config.NumberOfClasses());
+      MdispSelect(MilDisplay, AllClassesImage);
+      }
 
-   // Display a representative image of all classes.
-   MIL_UNIQUE_BUF_ID AllClassesImage = CreateImageOfAllClasses(MilSystem, CLASS_ICONS, CLASS_NAMES, NUMBER_OF_CLASSES);
-   MdispSelect(MilDisplay, AllClassesImage);
+   // Only delete the old output folders left by ResetMode=deferred.
+   if(Config.CollectGarbage)
+      {
+      return CollectOldFolders(Config.DestDataPath) ? 0 : 1;
+      }
+
+   // In merge mode, the partial datasets of the shards are combined and nothing else is done.
+   if(Config.MergeShardCount > 0)
+      return MergeShardDatasets(MilSystem, Config) ? 0 : 1;
+
+   const bool IsShard = Config.ShardCount > 1;
+
+   // Open the source of the images and labels.
+   std::unique_ptr<CImageSource> Source = CreateImageSource(Config);
+   if(!Source)
+      return 1;
+
+   // Only compare the tile copies on the first source image.
+   if(Config.BenchmarkTileCopy)
+      {
+      std::vector<MIL_STRING> FileNames;
+      Source->ListImages(FileNames);
+      if(!FileNames.empty())
+         BenchmarkTileCopy(MilSystem, *Source, FileNames[0], Config.NoAugImageSize, Config.RandomSeed);
+      return 0;
+      }
+
+   MIL_DOUBLE StartTime;
+   MappTimer(M_DEFAULT, M_TIMER_READ, &StartTime);
 
    MosPrintf(MIL_TEXT("Preparing the tiles... \n"));
 
    // If the destination does not already exist we will create the appropriate
    // ExampleDataPath folders structure.
    // If the structure is already existing, then we will remove previous
-   // data to ensure repeatability.
-   PrepareExampleDataFolder(MilApplication, EXAMPLE_DEST_DATA_PATH, CLASS_NAMES, NUMBER_OF_CLASSES);
+   // data to ensure repeatability. The shards share the destination folder,
+   // so they must not delete the tiles of the other shards.
+   // Instead of deleting the previous tiles one by one, the previous output
+   // can be renamed aside and deleted in the background, or later on.
+   std::thread OldOutputDeletion;
+   MIL_STRING OldOutputFolder;
+   if(!IsShard && Config.ResetMode != MIL_TEXT("delete") && MoveFolderAside(Config.DestDataPath, OldOutputFolder))
+      {
+      if(Config.ResetMode == MIL_TEXT("swap"))
+         OldOutputDeletion = std::thread(DeleteFolderTree, OldOutputFolder);
+      else
+         MosPrintf(MIL_TEXT("\nThe previous output was moved to %s; run with --CollectGarbage=1 to delete it.\n"), OldOutputFolder.c_str());
+      }
+   PrepareExampleDataFolder(Config.DestDataPath, Config.ClassNames.data(), Config.NumberOfClasses(), Config.OutputFanOut, !IsShard);
+
+   // The label cache is kept from one run to the next; only create its folder.
+   if(!Config.LabelCacheDir.empty())
+      CreateDirectory(Config.LabelCacheDir.c_str(), NULL);
 
    // We create a dataset with all the data
    MosPrintf(MIL_TEXT("\nCreating the dataset containing all the fullframe data...\n"));
@@ -165,110 +409,227 @@ int MosMain()
    MIL_UNIQUE_CLASS_ID TrainDataset        = MclassAlloc(MilSystem, M_DATASET_IMAGES, M_DEFAULT, M_UNIQUE_ID);
    MIL_UNIQUE_CLASS_ID DevDataset          = MclassAlloc(MilSystem, M_DATASET_IMAGES, M_DEFAULT, M_UNIQUE_ID);
 
-   MclassControl(FullFrameDataset   , M_CONTEXT, M_ROOT_PATH, EXAMPLE_IMAGE_PATH);
-   MclassControl(WorkingTrainDataset, M_CONTEXT, M_ROOT_PATH, EXAMPLE_IMAGE_PATH);
-   MclassControl(WorkingDevDataset  , M_CONTEXT, M_ROOT_PATH, EXAMPLE_IMAGE_PATH);
+   MclassControl(FullFrameDataset   , M_CONTEXT, M_ROOT_PATH, Config.ImagePath);
+   MclassControl(WorkingTrainDataset, M_CONTEXT, M_ROOT_PATH, Config.ImagePath);
+   MclassControl(WorkingDevDataset  , M_CONTEXT, M_ROOT_PATH, Config.ImagePath);
    MclassControl(TrainDataset       , M_CONTEXT, M_ROOT_PATH, GetExampleCurrentDirectory());
    MclassControl(DevDataset         , M_CONTEXT, M_ROOT_PATH, GetExampleCurrentDirectory());
 
-   AddClassDefinitions(MilSystem, FullFrameDataset, CLASS_NAMES, CLASS_ICONS, NUMBER_OF_CLASSES);
+   AddClassDefinitions(MilSystem, FullFrameDataset, Config.ClassNames.data(), Config.ClassIcons.empty() ? M_NULL : Config.ClassIcons.data(), Config.NumberOfClasses());
    MclassCopy(FullFrameDataset, M_DEFAULT, TrainDataset, M_DEFAULT, M_CLASS_DEFINITIONS, M_DEFAULT);
    MclassCopy(FullFrameDataset, M_DEFAULT, DevDataset, M_DEFAULT, M_CLASS_DEFINITIONS, M_DEFAULT);
 
-   // Add all the images into a dataset. 
-   AddFolderToDataset(MilApplication, EXAMPLE_IMAGE_PATH, FullFrameDataset);
+   // From here, the stages hand their entries over through in-memory tables.
+   // The source index of an image is its position in the listing.
+   CEntryTable TrainSourceImages, DevSourceImages;
+
+   if(Config.SplitMode == MIL_TEXT("hash"))
+      {
+      MosPrintf(MIL_TEXT("\nSplitting the source images to train/dev by hash...\n"));
+
+      // Each image is assigned on its own, so the shards directly keep theirs.
+      std::vector<MIL_STRING> SourceImages;
+      Source->ListImages(SourceImages);
+      SplitSourceImagesByHash(SourceImages, SourceImages, Config, TrainSourceImages, DevSourceImages);
+      }
+   else if(Config.SplitMode == MIL_TEXT("group"))
+      {
+      MosPrintf(MIL_TEXT("\nSplitting the source images to train/dev by group...\n"));
+
+      // The images are assigned from the hash of their group instead of their name.
+      std::vector<MIL_STRING> SourceImages, Groups;
+      Source->ListImages(SourceImages);
+      MIL_INT NbGroups = GetSourceImageGroups(*Source, SourceImages, Config.SplitGroupPattern, Groups);
+      MosPrintf(MIL_TEXT("%d source images in %d groups.\n"), (int)SourceImages.size(), (int)NbGroups);
+      SplitSourceImagesByHash(SourceImages, Groups, Config, TrainSourceImages, DevSourceImages);
+      }
+   else
+      {
+      // Add all the images into a dataset. 
+      AddSourceToDataset(*Source, FullFrameDataset);
 
-   MosPrintf(MIL_TEXT("\nSplitting the fullframe dataset to train/dev datasets...\n"));
+      MosPrintf(MIL_TEXT("\nSplitting the fullframe dataset to train/dev datasets...\n"));
 
-   // We want to split: Train=80% and Dev=20%.
-   const MIL_DOUBLE PERCENTAGE_IN_TRAIN_DATASET = 80.0;
+      // Split the dataset to train and dev datasets.
+      MclassSplitDataset(M_SPLIT_CONTEXT_FIXED_SEED, FullFrameDataset, WorkingTrainDataset, WorkingDevDataset,
+                         Config.PercentageInTrainDataset, M_NULL, M_DEFAULT);
 
-   // Split the dataset to train and dev datasets.
-   MclassSplitDataset(M_SPLIT_CONTEXT_FIXED_SEED, FullFrameDataset, WorkingTrainDataset, WorkingDevDataset,
-                      PERCENTAGE_IN_TRAIN_DATASET, M_NULL, M_DEFAULT);
+      std::map<MIL_STRING, MIL_INT> ListingIndices;
+      GetListingIndices(FullFrameDataset, ListingIndices);
+      TrainSourceImages.LoadFromDataset(WorkingTrainDataset, &ListingIndices);
+      DevSourceImages.LoadFromDataset(WorkingDevDataset, &ListingIndices);
+
+      // The split uses a fixed seed, so every shard gets the same train/dev
+      // assignment and only keeps its own subset of the source images.
+      if(IsShard)
+         {
+         MosPrintf(MIL_TEXT("\nSelecting the source images of shard %d/%d...\n"), (int)Config.ShardIndex, (int)Config.ShardCount);
+
+         CEntryTable ShardTrainImages, ShardDevImages;
+         SelectShardEntries(TrainSourceImages, Config.ShardIndex, Config.ShardCount, ShardTrainImages);
+         SelectShardEntries(DevSourceImages, Config.ShardIndex, Config.ShardCount, ShardDevImages);
+         TrainSourceImages = std::move(ShardTrainImages);
+         DevSourceImages   = std::move(ShardDevImages);
+         }
+      }
 
    // There are different methods of extracting tiles from an image.
    // Tiles could be randomly extracted from the image,
    // or could be extracted using a grid,
    // or using blob analysis.
    // When using blob analysis, the center of gravity of the blob could be used to extract the tiles. 
+   CEntryTable TrainEntries, DevEntries;
+
+   // All the stages save their tiles through the same writer.
+   CTileWriter TileWriter(MilSystem, Config.OutputEncoding, Config.OutputThreads);
+
+   // With DirectCrop, the train tiles are augmented as they are extracted.
+   std::unique_ptr<CTileAugmenter> TrainAugmenter;
+   if(Config.DirectCrop)
+      TrainAugmenter.reset(new CTileAugmenter(MilSystem, Config.NbAugmentationPerImage.data(), Config.TileImageSize, Config.RandomSeed, TileWriter));
+
+   // The random and CoG tiles of a source image are checked against each
+   // other for near-duplicates. The source indices of the train and dev
+   // tables overlap, so each table has its own index.
+   std::unique_ptr<CTileHashIndex> TrainTileHashes, DevTileHashes;
+   if(Config.NearDuplicateDistance >= 0)
+      {
+      TrainTileHashes.reset(new CTileHashIndex(MilSystem, Config.NearDuplicateDistance));
+      DevTileHashes.reset(new CTileHashIndex(MilSystem, Config.NearDuplicateDistance));
+      }
 
    MosPrintf(MIL_TEXT("\nExtract random tiles from the trainset...\n"));
 
    // Randomly extract tiles and add them to the dataset.
    ExtractRandomTiles(MilSystem,
-                      WorkingTrainDataset,
-                      NB_RAND_TILES_PER_IMAGE,
-                      NO_AUG_IMAGE_SIZE,
-                      NO_AUG_IMAGE_SIZE,
-                      EXAMPLE_IMAGE_PATH,
-                      EXAMPLE_LABEL_PATH,
-                      EXAMPLE_DEST_DATA_PATH,
-                      CLASS_NAMES,
-                      TrainDataset);
+                      *Source,
+                      TrainSourceImages,
+                      Config.NbRandTilesPerImage,
+                      Config.NoAugImageSize,
+                      Config.NoAugImageSize,
+                      Config,
+                      TrainTileHashes.get(),
+                      TrainAugmenter.get(),
+                      TileWriter,
+                      TrainEntries);
 
    MosPrintf(MIL_TEXT("\nExtract random tiles from the devset...\n"));
    // Randomly extract tiles and add them to the dataset.
    ExtractRandomTiles(MilSystem,
-                      WorkingDevDataset,
-                      NB_RAND_TILES_PER_IMAGE,
-                      NO_AUG_IMAGE_SIZE,
-                      NO_AUG_IMAGE_SIZE,
-                      EXAMPLE_IMAGE_PATH,
-                      EXAMPLE_LABEL_PATH,
-                      EXAMPLE_DEST_DATA_PATH,
-                      CLASS_NAMES,
-                      DevDataset);
+                      *Source,
+                      DevSourceImages,
+                      Config.NbRandTilesPerImage,
+                      Config.NoAugImageSize,
+                      Config.NoAugImageSize,
+                      Config,
+                      DevTileHashes.get(),
+                      nullptr,
+                      TileWriter,
+                      DevEntries);
 
    MosPrintf(MIL_TEXT("\nExtract CoG tiles from the trainset...\n"));
    // Use CoG to extract tiles and add them to the dataset
    ExtractCoGTiles(MilSystem,
-                   WorkingTrainDataset,
-                   NUMBER_OF_CLASSES,
-                   NO_AUG_IMAGE_SIZE,
-                   NO_AUG_IMAGE_SIZE,
-                   EXAMPLE_IMAGE_PATH,
-                   EXAMPLE_LABEL_PATH,
-                   EXAMPLE_DEST_DATA_PATH,
-                   CLASS_NAMES,
-                   TrainDataset);
+                   *Source,
+                   TrainSourceImages,
+                   Config.NoAugImageSize,
+                   Config.NoAugImageSize,
+                   Config,
+                   TrainTileHashes.get(),
+                   TrainAugmenter.get(),
+                   TileWriter,
+                   TrainEntries);
 
    MosPrintf(MIL_TEXT("\nExtract CoG tiles from the devset...\n"));
    // Use CoG to extract tiles and add them to the dataset.
    ExtractCoGTiles(MilSystem,
-                   WorkingDevDataset,
-                   NUMBER_OF_CLASSES,
-                   NO_AUG_IMAGE_SIZE,
-                   NO_AUG_IMAGE_SIZE,
-                   EXAMPLE_IMAGE_PATH,
-                   EXAMPLE_LABEL_PATH,
-                   EXAMPLE_DEST_DATA_PATH,
-                   CLASS_NAMES,
-                   DevDataset);
+                   *Source,
+                   DevSourceImages,
+                   Config.NoAugImageSize,
+                   Config.NoAugImageSize,
+                   Config,
+                   DevTileHashes.get(),
+                   nullptr,
+                   TileWriter,
+                   DevEntries);
+
+   if(TrainTileHashes)
+      {
+      MosPrintf(MIL_TEXT("\nDropped %d train and %d dev near-duplicate tiles.\n"),
+                (int)TrainTileHashes->NumberOfDropped(), (int)DevTileHashes->NumberOfDropped());
+      }
+
+   // The next stages read the saved tiles back. A stage stops the preparation
+   // if some of its tiles could not be written, since their entries would
+   // point to missing files.
+   bool AllTilesWritten = TileWriter.Flush();
+
+   if(AllTilesWritten && !TrainAugmenter)
+      {
+      MosPrintf(MIL_TEXT("\nAugmenting the train dataset...\n"));
+
+      // Perform data augmentation to the TrainDataset. The augmented tiles are
+      // saved at their final size.
+      AugmentDataset(MilSystem, TrainEntries, Config.NbAugmentationPerImage.data(), Config.TileImageSize, Config.RandomSeed, TileWriter);
+      AllTilesWritten = TileWriter.Flush();
+      }
 
-   MosPrintf(MIL_TEXT("\nAugmenting the train dataset...\n"));
+   if(AllTilesWritten)
+      {
+      // Crop the dataset images to ensure that they have the required size for the application.
+      MosPrintf(MIL_TEXT("\nCropping images from the train/dev datasets.\n"));
 
-   // Perform data augmentation to the TrainDataset.
-   AugmentDataset(MilSystem, TrainDataset, NB_AUGMENTATION_PER_IMAGE);
+      MosPrintf(MIL_TEXT("\nCropping images from the train dataset...\n"));
+      CropDatasetImages(MilSystem, TrainEntries, Config.TileImageSize, TileWriter);
 
-   // Crop the dataset images to ensure that they have the required size for the application.
-   MosPrintf(MIL_TEXT("\nCropping images from the train/dev datasets.\n"));
+      MosPrintf(MIL_TEXT("\nCropping images from the dev dataset...\n"));
+      CropDatasetImages(MilSystem, DevEntries, Config.TileImageSize, TileWriter);
+      AllTilesWritten = TileWriter.Flush();
+      }
 
-   MosPrintf(MIL_TEXT("\nCropping images from the train dataset...\n"));
-   CropDatasetImages(MilSystem, TrainDataset, TILE_IMAGE_SIZE);
+   if(!AllTilesWritten)
+      {
+      MosPrintf(MIL_TEXT("The datasets are not saved.\n"));
+      if(OldOutputDeletion.joinable())
+         OldOutputDeletion.join();
+      return 1;
+      }
 
-   MosPrintf(MIL_TEXT("\nCropping images from the dev dataset...\n"));
-   CropDatasetImages(MilSystem, DevDataset, TILE_IMAGE_SIZE);
+   // Build the datasets from the entry tables.
+   TrainEntries.CommitToDataset(TrainDataset);
+   DevEntries.CommitToDataset(DevDataset);
 
-   // Save the datasets.
-   MclassSave(MIL_TEXT("TrainDataset.mclassd"), TrainDataset, M_DEFAULT);
-   MclassSave(MIL_TEXT("DevDataset.mclassd"), DevDataset, M_DEFAULT);
+   // Save the datasets. The shards save partial datasets to be merged later.
+   if(IsShard)
+      {
+      MclassSave(GetShardDatasetFile(Config.TrainDatasetFile, Config.ShardIndex, Config.ShardCount), TrainDataset, M_DEFAULT);
+      MclassSave(GetShardDatasetFile(Config.DevDatasetFile, Config.ShardIndex, Config.ShardCount), DevDataset, M_DEFAULT);
+      }
+   else
+      {
+      MclassSave(Config.TrainDatasetFile, TrainDataset, M_DEFAULT);
+      MclassSave(Config.DevDatasetFile, DevDataset, M_DEFAULT);
+      }
 
    // Useful to export entries from different sets if one wants to ensure that
    // data preparation has worked as expected. Uncomment if required.
    //MclassExport(MIL_TEXT("TrainDataset.csv"), M_FORMAT_CSV, TrainDataset, M_DEFAULT, M_ENTRIES, M_DEFAULT);
    //MclassExport(MIL_TEXT("DevDataset.csv"), M_FORMAT_CSV, DevDataset, M_DEFAULT, M_ENTRIES, M_DEFAULT);
 
+   // Report the throughput so that runs with different parameters can be compared.
+   MIL_DOUBLE EndTime;
+   MappTimer(M_DEFAULT, M_TIMER_READ, &EndTime);
+   MIL_INT NbTrainEntries = TrainEntries.NumberOfEntries();
+   MIL_INT NbDevEntries = DevEntries.NumberOfEntries();
+   MosPrintf(MIL_TEXT("\nPrepared %d train and %d dev tiles of %dx%d in %.2f s (%.1f tiles/s).\n"),
+             (int)NbTrainEntries, (int)NbDevEntries, (int)Config.TileImageSize, (int)Config.TileImageSize,
+             EndTime - StartTime, (NbTrainEntries + NbDevEntries) / std::max(EndTime - StartTime, 1e-6));
+
+   if(OldOutputDeletion.joinable())
+      {
+      MosPrintf(MIL_TEXT("Waiting for the previous output to be deleted...\n"));
+      OldOutputDeletion.join();
+      }
 
    return 0;
    }
@@ -276,142 +637,195 @@ int MosMain()
 
 // This function extracts random tiles from images and adds them to the dataset. 
 void ExtractRandomTiles(MIL_ID MilSystem,
-                        MIL_ID SourceDataset,
+                        CImageSource& Source,
+                        const CEntryTable& SourceImages,
                         MIL_INT NbTiles,
                         MIL_INT TileSizeX,
                         MIL_INT TileSizeY,
-                        MIL_STRING ImagesPath,
-                        MIL_STRING LabelsPath,
-                        MIL_STRING DestPath,
-                        MIL_STRING* ClassNames,
-                        MIL_ID DestDataset)
+                        const SDataPrepConfig& Config,
+                        CTileHashIndex* TileHashes,
+                        CTileAugmenter* Augmenter,
+                        CTileWriter& Writer,
+                        CEntryTable& DestEntries)
    {
-   // Inquire the number of images already added to the datasets. 
-   MIL_INT SrcNbEntries, DstNbEntries, CurImageIndex = 0;
-   MclassInquire(SourceDataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &SrcNbEntries);
-   MclassInquire(DestDataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &DstNbEntries);
+   MIL_INT SrcNbEntries = SourceImages.NumberOfEntries();
+   DestEntries.Reserve(DestEntries.NumberOfEntries() + SrcNbEntries * NbTiles);
+   CTilePathBuilder PathBuilder(Config.DestDataPath, Config.ClassNames, Config.OutputFanOut, Writer.Extension());
+   CLabelCache LabelCache(Config.LabelCacheDir);
+   CLabelBlockIndex LabelBlocks;
+   CImageBandReader ImageReader;
+   std::vector<STileToExtract> Tiles;
+   std::vector<MIL_INT> ClassCounts;
+   CSpacedPositions SpacedPositions;
+   MIL_DOUBLE MinDistance = Config.RandomTileSpacing * (MIL_DOUBLE)std::min(TileSizeX, TileSizeY);
 
    for(MIL_INT ind = 0; ind < SrcNbEntries; ind++)
       {
       MosPrintf(MIL_TEXT("   %d of %d completed\r"), ind + 1, SrcNbEntries);
 
-      // Get the filenames.
-      MIL_STRING FileName, ImgPath, LblPath;
-      MclassInquireEntry(SourceDataset, ind, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FileName);
-      ImgPath = ImagesPath + FileName;
-      LblPath = LabelsPath + FileName;
+      // Get the filename.
+      MIL_STRING FileName = SourceImages.FilePath(ind);
 
-      // Load the original image and the label image. 
-      auto OriginalImage = MbufRestore(ImgPath, MilSystem, M_UNIQUE_ID);
-      auto OriginalLabel = MbufRestore(LblPath, MilSystem, M_UNIQUE_ID);
+      // Open the original image and load the index of its label image. 
+      if(!Source.OpenImage(MilSystem, FileName, ImageReader) ||
+         !RestoreLabelIndex(Source, MilSystem, FileName, LabelCache, false, Config.BandHeight, TileSizeY, LabelBlocks))
+         continue;
 
-      MIL_INT ImageSizeX = MbufInquire(OriginalImage, M_SIZE_X, M_NULL);
-      MIL_INT ImageSizeY = MbufInquire(OriginalImage, M_SIZE_Y, M_NULL);
-      MIL_INT ImageSizeBand = MbufInquire(OriginalImage, M_SIZE_BAND, M_NULL);
+      MIL_INT ImageSizeX = ImageReader.SizeX();
+      MIL_INT ImageSizeY = ImageReader.SizeY();
+      MIL_INT ImageSizeBand = ImageReader.SizeBand();
+
+      // The random offsets are drawn in [0, ImageSize - TileSize - 1).
+      if(!CheckTileFits(FileName, ImageSizeX, ImageSizeY, TileSizeX, TileSizeY, 2))
+         continue;
 
-      // Allocate the buffers for the image and label tiles. 
+      // The tile names only differ by their suffix.
+      PathBuilder.SetSource(FileName.c_str());
+
+      // Allocate the buffer for the image tiles. 
       auto MilTileImg = MbufAllocColor(MilSystem, ImageSizeBand, TileSizeX, TileSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
-      auto MilTileLbl = MbufAlloc2d(MilSystem, TileSizeX, TileSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+
+      // Each image has its own generator so that its tiles are the same
+      // whatever the shard or the order in which the images are processed.
+      std::mt19937 Generator((unsigned int)HashString(FileName, Config.RandomSeed));
 
       // The tile should reside inside the orignal image. 
       MIL_INT OffsetX, OffsetY;
       MIL_INT MaxOffsetX = ImageSizeX - TileSizeX - 1;
       MIL_INT MaxOffsetY = ImageSizeY - TileSizeY - 1;
 
-      // For each image generates N tiles. 
+      // For each image generates N tiles. Without spacing, a single
+      // position is drawn per tile, as the draws are independent.
+      Tiles.clear();
+      if(MinDistance > 0.0)
+         SpacedPositions.Reset(MinDistance);
       for(int TileIndex = 1; TileIndex < NbTiles; TileIndex++)
          {
          // Generate random position. 
-         OffsetX = rand() % MaxOffsetX;
-         OffsetY = rand() % MaxOffsetY;
-
-         MbufCopyColor2d(OriginalImage, MilTileImg, M_ALL_BANDS, OffsetX, OffsetY, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY);
-         MbufCopyColor2d(OriginalLabel, MilTileLbl, M_ALL_BANDS, OffsetX, OffsetY, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY);
-
-         // Compute the ground truth label of the extracted tile. 
-         MIL_DOUBLE GroundTruth = GetRetinaLabel(MilSystem, MilTileLbl, LABEL_RETINA_SIZE, LABEL_RETINA_SIZE);
-
-         // Save the tile. 
-         MIL_TEXT_CHAR Suffix[128];
-         MosSprintf(Suffix, 128, MIL_TEXT("_Tile_%0.2d"), TileIndex);
-         MIL_STRING TileFileName = DestPath + ClassNames[int(GroundTruth)] + MIL_TEXT("\\") + FileName;
-         std::size_t DotPos = TileFileName.rfind(MIL_TEXT("."));
-         TileFileName.insert(DotPos, Suffix);
-         MbufSave(TileFileName, MilTileImg);
-
-         // Add the saved tile to the dataset.
-         MclassControl(DestDataset, M_DEFAULT, M_ENTRY_ADD, M_DEFAULT);
-         MclassControlEntry(DestDataset, DstNbEntries + CurImageIndex, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH, GroundTruth, M_NULL, M_DEFAULT);
-         MclassControlEntry(DestDataset, DstNbEntries + CurImageIndex, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, M_DEFAULT, TileFileName, M_DEFAULT);
-         CurImageIndex++;
+         bool IsPlaced = false;
+         for(MIL_INT Attempt = 0; !IsPlaced && Attempt < (MinDistance > 0.0 ? Config.MaxSpacingAttempts : 1); Attempt++)
+            {
+            OffsetX = (MIL_INT)(Generator() % MaxOffsetX);
+            OffsetY = (MIL_INT)(Generator() % MaxOffsetY);
+            IsPlaced = MinDistance <= 0.0 || SpacedPositions.TryAdd(OffsetX, OffsetY);
+            }
+         if(!IsPlaced)
+            continue;
+
+         // Compute the ground truth label of the tile. 
+         MIL_INT GroundTruth = GetRetinaClass(LabelBlocks, OffsetX, OffsetY, TileSizeX, TileSizeY,
+                                              Config.LabelRetinaSize, Config.LabelRetinaSize, Config, ClassCounts);
+         Tiles.push_back({GroundTruth, OffsetX, OffsetY, TileIndex, -1});
          }
+
+      // Cut the tiles, save them and add them to the entries. 
+      ExtractTilesByBand(ImageReader, SourceImages.SourceIndex(ind), Tiles, MIL_TEXT("_Tile_"), false, MilTileImg, PathBuilder, Config, TileHashes, Augmenter, Writer, DestEntries);
       }
 
    MosPrintf(MIL_TEXT("\n"));
    }
 
+bool CheckTileFits(const MIL_STRING& FileName, MIL_INT ImageSizeX, MIL_INT ImageSizeY, MIL_INT TileSizeX, MIL_INT TileSizeY, MIL_INT MinMargin)
+   {
+   if(ImageSizeX >= TileSizeX + MinMargin && ImageSizeY >= TileSizeY + MinMargin)
+      return true;
+
+   MosPrintf(MIL_TEXT("\n%s (%dx%d) is too small for the %dx%d tiles; it is skipped.\n"), FileName.c_str(),
+             (int)ImageSizeX, (int)ImageSizeY, (int)TileSizeX, (int)TileSizeY);
+   return false;
+   }
+
+void CSpacedPositions::Reset(MIL_DOUBLE MinDistance)
+   {
+   m_MinDistance2 = MinDistance * MinDistance;
+   m_CellSize = std::max(MinDistance / std::sqrt(2.0), 1.0);
+   m_Cells.clear();
+   m_PositionsX.clear();
+   m_PositionsY.clear();
+   }
+
+bool CSpacedPositions::TryAdd(MIL_INT X, MIL_INT Y)
+   {
+   // With a cell at most MinDistance / sqrt(2) wide, the positions closer
+   // than MinDistance are at most 2 cells away.
+   MIL_INT CellX = (MIL_INT)(X / m_CellSize);
+   MIL_INT CellY = (MIL_INT)(Y / m_CellSize);
+   for(MIL_INT NeighborY = std::max<MIL_INT>(CellY - 2, 0); NeighborY <= CellY + 2; NeighborY++)
+      {
+      for(MIL_INT NeighborX = std::max<MIL_INT>(CellX - 2, 0); NeighborX <= CellX + 2; NeighborX++)
+         {
+         auto Cell = m_Cells.find(CellKey(NeighborX, NeighborY));
+         if(Cell == m_Cells.end())
+            continue;
+         MIL_INT32 Index = Cell->second;
+         MIL_DOUBLE DeltaX = (MIL_DOUBLE)(m_PositionsX[Index] - X);
+         MIL_DOUBLE DeltaY = (MIL_DOUBLE)(m_PositionsY[Index] - Y);
+         if(DeltaX * DeltaX + DeltaY * DeltaY < m_MinDistance2)
+            return false;
+         }
+      }
+
+   m_Cells[CellKey(CellX, CellY)] = (MIL_INT32)m_PositionsX.size();
+   m_PositionsX.push_back((MIL_INT32)X);
+   m_PositionsY.push_back((MIL_INT32)Y);
+   return true;
+   }
+
 void ExtractCoGTiles(MIL_ID MilSystem,
-                     MIL_ID SourceDataset,
-                     MIL_INT NbClasses,
+                     CImageSource& Source,
+                     const CEntryTable& SourceImages,
                      MIL_INT TileSizeX,
                      MIL_INT TileSizeY,
-                     MIL_STRING ImagesPath,
-                     MIL_STRING LabelsPath,
-                     MIL_STRING DestPath,
-                     MIL_STRING* ClassNames,
-                     MIL_ID DestDataset)
-   {
-   // Inquire the number of images already added to the datasets. 
-   MIL_INT SrcNbEntries, DstNbEntries, CurImageIndex = 0;
-   MclassInquire(SourceDataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &SrcNbEntries);
-   MclassInquire(DestDataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &DstNbEntries);
-
-   // Allocate blob analysis to locate the CoG of classes. 
-   auto MilBlobCtx = MblobAlloc(MilSystem, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
-   auto MilBlobRslt = MblobAllocResult(MilSystem, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
-   MblobControl(MilBlobCtx, M_CENTER_OF_GRAVITY, M_ENABLE);
+                     const SDataPrepConfig& Config,
+                     CTileHashIndex* TileHashes,
+                     CTileAugmenter* Augmenter,
+                     CTileWriter& Writer,
+                     CEntryTable& DestEntries)
+   {
+   MIL_INT SrcNbEntries = SourceImages.NumberOfEntries();
+   CTilePathBuilder PathBuilder(Config.DestDataPath, Config.ClassNames, Config.OutputFanOut, Writer.Extension());
+   CLabelCache LabelCache(Config.LabelCacheDir);
+
+   // The label index also locates the CoG of the blobs of the classes. 
+   CLabelBlockIndex LabelBlocks;
+   CImageBandReader ImageReader;
+   std::vector<STileToExtract> Tiles;
 
    // Iterate over all the entries.
    for(MIL_INT ind = 0; ind < SrcNbEntries; ind++)
       {
       MosPrintf(MIL_TEXT("   %d of %d completed\r"), ind + 1, SrcNbEntries);
 
-      // Get the file names.
-      MIL_STRING FileName, ImgPath, LblPath;
-      MclassInquireEntry(SourceDataset, ind, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FileName);
-      ImgPath = ImagesPath + FileName;
-      LblPath = LabelsPath + FileName;
+      // Get the file name.
+      MIL_STRING FileName = SourceImages.FilePath(ind);
 
-      // Load the original image and the label image. 
-      auto OriginalImage = MbufRestore(ImgPath, MilSystem, M_UNIQUE_ID);
-      auto OriginalLabel = MbufRestore(LblPath, MilSystem, M_UNIQUE_ID);
+      // Open the original image and load the index of its label image. 
+      if(!Source.OpenImage(MilSystem, FileName, ImageReader) ||
+         !RestoreLabelIndex(Source, MilSystem, FileName, LabelCache, true, Config.BandHeight, TileSizeY, LabelBlocks))
+         continue;
 
-      MIL_INT ImageSizeX = MbufInquire(OriginalImage, M_SIZE_X, M_NULL);
-      MIL_INT ImageSizeY = MbufInquire(OriginalImage, M_SIZE_Y, M_NULL);
-      MIL_INT ImageSizeBand = MbufInquire(OriginalImage, M_SIZE_BAND, M_NULL);
+      MIL_INT ImageSizeX = ImageReader.SizeX();
+      MIL_INT ImageSizeY = ImageReader.SizeY();
+      MIL_INT ImageSizeBand = ImageReader.SizeBand();
 
-      // Allocate Binarized Label and the tile image. 
-      auto MilBinLabel = MbufAlloc2d(MilSystem, ImageSizeX, ImageSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
-      auto MilTileImg  = MbufAllocColor(MilSystem, ImageSizeBand, TileSizeX, TileSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC + M_DISP, M_UNIQUE_ID);
-      auto MilTileLbl = MbufAllocColor(MilSystem, 1, TileSizeX, TileSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC + M_DISP, M_UNIQUE_ID);
+      // The tiles are moved inside the image, which must hold them.
+      if(!CheckTileFits(FileName, ImageSizeX, ImageSizeY, TileSizeX, TileSizeY, 0))
+         continue;
+
+      // The tile names only differ by their suffix.
+      PathBuilder.SetSource(FileName.c_str());
 
-      MIL_INT NbBlobs;
-      std::vector<MIL_INT> CentersX;
-      std::vector<MIL_INT> CentersY;
+      // Allocate the tile image. 
+      auto MilTileImg  = MbufAllocColor(MilSystem, ImageSizeBand, TileSizeX, TileSizeY, 8 + M_UNSIGNED, M_IMAGE + M_PROC + M_DISP, M_UNIQUE_ID);
 
       // Iterate over all the classes except class 0 since in this example 0 is the background. 
-      for(int LabelIndex = 1; LabelIndex < NbClasses; LabelIndex++)
+      Tiles.clear();
+      for(MIL_INT LabelIndex = 1; LabelIndex < Config.NumberOfClasses(); LabelIndex++)
          {
-         // Calculate the CoG for all the blobs. 
-         MimBinarize(OriginalLabel, MilBinLabel, M_FIXED + M_EQUAL, LabelIndex, M_NULL);
-         MblobCalculate(MilBlobCtx, MilBinLabel, M_NULL, MilBlobRslt);
-         MblobGetResult(MilBlobRslt, M_DEFAULT, M_NUMBER + M_TYPE_MIL_INT, &NbBlobs);
-
-         CentersX.resize(NbBlobs);
-         CentersY.resize(NbBlobs);
-
-         MblobGetResult(MilBlobRslt, M_DEFAULT, M_CENTER_OF_GRAVITY_X, CentersX);
-         MblobGetResult(MilBlobRslt, M_DEFAULT, M_CENTER_OF_GRAVITY_Y, CentersY);
+         // The CoG of all the blobs of the class. 
+         const std::vector<MIL_INT>& CentersX = LabelBlocks.BlobCentersX(Config.ClassLabelValues[LabelIndex]);
+         const std::vector<MIL_INT>& CentersY = LabelBlocks.BlobCentersY(Config.ClassLabelValues[LabelIndex]);
+         MIL_INT NbBlobs = (MIL_INT)CentersX.size();
 
          // Iterate over all the blobs.
          for(int TileIndex = 0; TileIndex < NbBlobs; TileIndex++)
@@ -422,63 +836,125 @@ void ExtractCoGTiles(MIL_ID MilSystem,
             OffsetX = std::min<MIL_INT>(OffsetX, ImageSizeX - TileSizeX);
             OffsetY = std::min<MIL_INT>(OffsetY, ImageSizeY - TileSizeY);
 
-            // Clear the destination and copy the data. 
-            MbufClear(MilTileImg, M_COLOR_BLACK);
-            MbufCopyColor2d(OriginalImage, MilTileImg, M_ALL_BANDS, OffsetX, OffsetY, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY);
-
-            // Clear the destination and copy the label. 
-            MbufClear(MilTileLbl, M_COLOR_BLACK);
-            MbufCopyColor2d(OriginalLabel, MilTileLbl, M_ALL_BANDS, OffsetX, OffsetY, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY);
-
             // To check if the defect is not next to the border and the defects dont overlap. 
-            MIL_DOUBLE RetinaLabel = GetRetinaLabel(MilSystem, MilTileLbl, (MIL_INT) (TILE_IMAGE_SIZE * 0.8), (MIL_INT) (TILE_IMAGE_SIZE * 0.8));
-            if(RetinaLabel == LabelIndex)
-               {
-               // Save the extraced tile. 
-               MIL_TEXT_CHAR Suffix[128];
-               MosSprintf(Suffix, 128, MIL_TEXT("_CoG_%0.2d_%0.2d"), LabelIndex, TileIndex);
-               MIL_STRING TileFileName = DestPath + ClassNames[LabelIndex] + MIL_TEXT("\\") + FileName;
-               std::size_t DotPos = TileFileName.rfind(MIL_TEXT("."));
-               TileFileName.insert(DotPos, Suffix);
-               MbufSave(TileFileName, MilTileImg);
-
-               // Add to dataset.
-               MclassControl(DestDataset, M_DEFAULT, M_ENTRY_ADD, M_DEFAULT);
-               MclassControlEntry(DestDataset, DstNbEntries + CurImageIndex, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH, LabelIndex, M_NULL, M_DEFAULT);
-               MclassControlEntry(DestDataset, DstNbEntries + CurImageIndex, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, M_DEFAULT, TileFileName, M_DEFAULT);
-               CurImageIndex++;
-               }
+            MIL_DOUBLE RetinaLabel = GetRetinaLabel(LabelBlocks, OffsetX, OffsetY, TileSizeX, TileSizeY,
+                                                    (MIL_INT) (Config.TileImageSize * 0.8), (MIL_INT) (Config.TileImageSize * 0.8));
+            if(LabelValueToClassIndex(Config, RetinaLabel) == LabelIndex)
+               Tiles.push_back({LabelIndex, OffsetX, OffsetY, LabelIndex, TileIndex});
             }
          }
+
+      // Cut the tiles, save them and add them to the entries. 
+      ExtractTilesByBand(ImageReader, SourceImages.SourceIndex(ind), Tiles, MIL_TEXT("_CoG_"), true, MilTileImg, PathBuilder, Config, TileHashes, Augmenter, Writer, DestEntries);
       }
 
    MosPrintf(MIL_TEXT("\n"));
    }
 
-// Uses a retina box to decide the label of a tile.
-MIL_DOUBLE GetRetinaLabel(MIL_ID MilSystem, MIL_ID LabelImage, MIL_INT RetinaSizeX, MIL_INT RetinaSizeY)
+void ExtractTilesByBand(CImageBandReader& Image,
+                        MIL_INT SourceIndex,
+                        std::vector<STileToExtract>& Tiles,
+                        const MIL_TEXT_CHAR* Tag,
+                        bool ClearTile,
+                        MIL_ID TileImage,
+                        CTilePathBuilder& PathBuilder,
+                        const SDataPrepConfig& Config,
+                        CTileHashIndex* TileHashes,
+                        CTileAugmenter* Augmenter,
+                        CTileWriter& Writer,
+                        CEntryTable& DestEntries)
    {
-   MIL_DOUBLE LabelValue;
-   MIL_INT SizeX, SizeY;
+   MIL_INT ImageSizeY = Image.SizeY();
+   MIL_INT TileSizeX = MbufInquire(TileImage, M_SIZE_X, M_NULL);
+   MIL_INT TileSizeY = MbufInquire(TileImage, M_SIZE_Y, M_NULL);
+   MIL_INT BandHeight = Config.BandHeight > 0 ? Config.BandHeight : ImageSizeY;
+   bool CopyFromRows = Config.TileCopy == MIL_TEXT("rows") && Image.IsMapped();
+
+   // A tile belongs to the band in which it starts. Within a band, the tiles
+   // keep the order in which they were generated.
+   std::stable_sort(Tiles.begin(), Tiles.end(), [BandHeight](const STileToExtract& a, const STileToExtract& b)
+      {
+      return a.OffsetY / BandHeight < b.OffsetY / BandHeight;
+      });
 
-   MbufInquire(LabelImage, M_SIZE_X, &SizeX);
-   MbufInquire(LabelImage, M_SIZE_Y, &SizeY);
+   for(std::size_t TileIndex = 0; TileIndex < Tiles.size(); )
+      {
+      // Only the bands that hold tiles are read, and none when the tiles are copied from the rows.
+      MIL_INT BandY = Tiles[TileIndex].OffsetY / BandHeight * BandHeight;
+      MIL_INT BandRows = std::min<MIL_INT>(BandHeight + TileSizeY, ImageSizeY - BandY);
+      MIL_ID Band = CopyFromRows ? M_NULL : Image.ReadBand(BandY, BandRows);
 
-   MIL_INT OffsetX = (SizeX - RetinaSizeX) / 2;
-   MIL_INT OffsetY = (SizeY - RetinaSizeY) / 2;
+      for(; TileIndex < Tiles.size() && Tiles[TileIndex].OffsetY < BandY + BandHeight; TileIndex++)
+         {
+         const STileToExtract& Tile = Tiles[TileIndex];
+         if(ClearTile)
+            MbufClear(TileImage, M_COLOR_BLACK);
+         if(CopyFromRows)
+            Image.CopyTile(Tile.OffsetX, Tile.OffsetY, TileImage);
+         else
+            MbufCopyColor2d(Band, TileImage, M_ALL_BANDS, Tile.OffsetX, Tile.OffsetY - BandY, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY);
 
-   auto MilRetinaImg = MbufChild2d(LabelImage, OffsetX, OffsetY, RetinaSizeX, RetinaSizeY, M_UNIQUE_ID);
+         // Drop the near-duplicates before they are saved and augmented.
+         if(TileHashes && !TileHashes->AddTile(TileImage, SourceIndex, Tile.ClassIndex, Tile.OffsetX, Tile.OffsetY))
+            continue;
+
+         // Save the extracted tile and add it to the entries. 
+         const MIL_STRING& TileFileName = PathBuilder.Build(Tile.ClassIndex, Tag, Tile.NameIndex0, Tile.NameIndex1);
+         SaveExtractedTile(TileImage, TileFileName, Tile.ClassIndex, SourceIndex, Tile.OffsetX, Tile.OffsetY, Config, Augmenter, Writer, DestEntries);
+         }
+      }
+   }
+
+// Uses a retina box to decide the label of a tile.
+MIL_DOUBLE GetRetinaLabel(const CLabelBlockIndex& LabelIndex,
+                          MIL_INT TileOffsetX,
+                          MIL_INT TileOffsetY,
+                          MIL_INT TileSizeX,
+                          MIL_INT TileSizeY,
+                          MIL_INT RetinaSizeX,
+                          MIL_INT RetinaSizeY)
+   {
+   MIL_INT OffsetX = TileOffsetX + (TileSizeX - RetinaSizeX) / 2;
+   MIL_INT OffsetY = TileOffsetY + (TileSizeY - RetinaSizeY) / 2;
 
    // In this example, if there are multiple label values in the retina box, 
    // we use the max value as the winner.
-   auto MilStatContext = MimAlloc(MilSystem, M_STATISTICS_CONTEXT, M_DEFAULT, M_UNIQUE_ID);
-   auto MilStatResult = MimAllocResult(MilSystem, M_DEFAULT, M_STATISTICS_RESULT, M_UNIQUE_ID);
+   return LabelIndex.GetRegionMax(OffsetX, OffsetY, RetinaSizeX, RetinaSizeY);
+   }
 
-   MimControl(MilStatContext, M_STAT_MAX, M_ENABLE);
-   MimStatCalculate(MilStatContext, MilRetinaImg, MilStatResult, M_DEFAULT);
-   MimGetResult(MilStatResult, M_STAT_MAX, &LabelValue);
+// Uses the fractions of the retina box covered by the classes to decide the
+// class of a tile, as set by RetinaMinFraction.
+MIL_INT GetRetinaClass(const CLabelBlockIndex& LabelIndex,
+                       MIL_INT TileOffsetX,
+                       MIL_INT TileOffsetY,
+                       MIL_INT TileSizeX,
+                       MIL_INT TileSizeY,
+                       MIL_INT RetinaSizeX,
+                       MIL_INT RetinaSizeY,
+                       const SDataPrepConfig& Config,
+                       std::vector<MIL_INT>& ClassCounts)
+   {
+   if(Config.RetinaMinFraction <= 0.0)
+      {
+      MIL_DOUBLE RetinaLabel = GetRetinaLabel(LabelIndex, TileOffsetX, TileOffsetY, TileSizeX, TileSizeY, RetinaSizeX, RetinaSizeY);
+      return LabelValueToClassIndex(Config, RetinaLabel);
+      }
 
-   return LabelValue;
+   // All the class counts come from a single histogram of the retina.
+   MIL_INT OffsetX = TileOffsetX + (TileSizeX - RetinaSizeX) / 2;
+   MIL_INT OffsetY = TileOffsetY + (TileSizeY - RetinaSizeY) / 2;
+   ClassCounts.assign((std::size_t)Config.NumberOfClasses(), 0);
+   LabelIndex.CountRegionValues(OffsetX, OffsetY, RetinaSizeX, RetinaSizeY,
+                                Config.ClassLabelValues.data(), Config.NumberOfClasses(), ClassCounts.data());
+
+   MIL_DOUBLE MinCount = std::max<MIL_DOUBLE>(Config.RetinaMinFraction * (MIL_DOUBLE)(RetinaSizeX * RetinaSizeY), 1.0);
+   MIL_INT Winner = 0;
+   for(MIL_INT i = 1; i < Config.NumberOfClasses(); i++)
+      {
+      if((MIL_DOUBLE)ClassCounts[(std::size_t)i] >= MinCount && Config.ClassLabelValues[i] > Config.ClassLabelValues[Winner])
+         Winner = i;
+      }
+   return Winner;
    }
 
 MIL_STRING GetExampleCurrentDirectory()
@@ -539,34 +1015,38 @@ const std::vector<MIL_INT> CreateShuffledIndex(MIL_INT NbEntries, unsigned int S
    return IndexVector;
    }
 
-void DeleteFiles(const std::vector<MIL_STRING>& Files)
-   {
-   for(const auto& FileName : Files)
-      {
-      MappFileOperation(M_DEFAULT, FileName, M_NULL, M_NULL, M_FILE_DELETE, M_DEFAULT, M_NULL);
-      }
-   }
-
-void ListFilesInFolder(const MIL_ID MilApplication, const MIL_STRING& FolderName, std::vector<MIL_STRING>& FilesInFolder)
+// Deletes the listed files with several threads, since the time is spent
+// waiting for the file system rather than computing. Returns the number of
+// files that could not be deleted; a file that is already gone is not counted.
+MIL_INT DeleteFiles(const CDirectoryListing& Files)
    {
-   MIL_STRING FileToSearch = FolderName;
-   FileToSearch += MIL_TEXT("*.bmp");
+   static const MIL_INT MIN_FILES_PER_THREAD = 256;
 
-   MIL_INT NumberOfFiles;
-   MappFileOperation(MilApplication, FileToSearch, M_NULL, M_NULL, M_FILE_NAME_FIND_COUNT, M_DEFAULT, &NumberOfFiles);
-   FilesInFolder.resize(NumberOfFiles);
+   MIL_INT NbFiles = Files.NumberOfFiles();
+   MIL_INT NbThreads = std::min<MIL_INT>(std::max(1u, std::thread::hardware_concurrency()), 16);
+   NbThreads = std::max<MIL_INT>(1, std::min(NbThreads, NbFiles / MIN_FILES_PER_THREAD));
 
-   std::vector<MIL_TEXT_CHAR> vFilename;
-   vFilename.reserve(260);
-   for (MIL_INT i = 0; i < NumberOfFiles; i++)
+   std::atomic<MIL_INT> NbFailures(0);
+   auto DeleteRange = [&Files, &NbFailures](MIL_INT First, MIL_INT Last)
       {
-      MIL_INT FilenameStrSize = 0;
-      MappFileOperation(MilApplication, FileToSearch, M_NULL, M_NULL, M_FILE_NAME_FIND + M_STRING_SIZE, i, &FilenameStrSize);
-
-      vFilename.resize(FilenameStrSize);
-      MappFileOperation(MilApplication, FileToSearch, M_NULL, M_NULL, M_FILE_NAME_FIND, i, &vFilename[0]);
-      FilesInFolder[i] = FolderName + &vFilename[0];
-      }
+      MIL_STRING FilePath = Files.FolderName();
+      std::size_t FolderLength = FilePath.size();
+      for(MIL_INT i = First; i < Last; i++)
+         {
+         FilePath.resize(FolderLength);
+         FilePath += Files.FileName(i);
+         if(!DeleteFile(FilePath.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND)
+            NbFailures++;
+         }
+      };
+
+   std::vector<std::thread> Threads;
+   for(MIL_INT t = 1; t < NbThreads; t++)
+      Threads.emplace_back(DeleteRange, NbFiles * t / NbThreads, NbFiles * (t + 1) / NbThreads);
+   DeleteRange(0, NbFiles / NbThreads);
+   for(auto& Thread : Threads)
+      Thread.join();
+   return NbFailures;
    }
 
 void AddClassDefinitions(MIL_ID MilSystem,
@@ -578,20 +1058,114 @@ void AddClassDefinitions(MIL_ID MilSystem,
    for(MIL_INT i = 0; i < NumberOfClasses; i++)
       {
       MclassControl(Dataset, M_DEFAULT, M_CLASS_ADD, ClassName[i]);
+
+      // The icons are optional when the classes come from a configuration file.
+      if(ClassIcon == M_NULL || ClassIcon[i].empty())
+         continue;
       MIL_UNIQUE_BUF_ID IconImageId = MbufRestore(ClassIcon[i], MilSystem, M_UNIQUE_ID);
       MclassControl(Dataset, M_CLASS_INDEX(i), M_CLASS_ICON_ID, IconImageId.get());
       }
    }
 
-void DeleteFilesInFolder(const MIL_ID MilApplication, const MIL_STRING& FolderName)
+void DeleteFilesInFolder(const MIL_STRING& FolderName)
    {
-   std::vector<MIL_STRING> FilesInFolder;
-   ListFilesInFolder(MilApplication, FolderName, FilesInFolder);
-   DeleteFiles(FilesInFolder);
+   CDirectoryListing FilesInFolder;
+   // The tiles can be in fan-out subfolders, and in any output encoding.
+   FilesInFolder.Scan(FolderName, MIL_STRING(), true);
+   MIL_INT NbFailures = DeleteFiles(FilesInFolder);
+   if(NbFailures > 0)
+      MosPrintf(MIL_TEXT("\n%d files could not be deleted from %s.\n"), (int)NbFailures, FolderName.c_str());
+   }
+
+// Deletes a folder with all its files and subfolders. Returns, and reports,
+// the number of files and folders that could not be deleted.
+MIL_INT DeleteFolderTree(const MIL_STRING& FolderName)
+   {
+   MIL_STRING FolderPath = FolderName;
+   if(!FolderPath.empty() && FolderPath.back() != MIL_TEXT('\\') && FolderPath.back() != MIL_TEXT('/'))
+      FolderPath += MIL_TEXT('\\');
+
+   CDirectoryListing Tree;
+   Tree.Scan(FolderPath, MIL_STRING(), true);
+   MIL_INT NbFailures = DeleteFiles(Tree);
+
+   // The subfolders are listed after their parent, so they are removed in
+   // the reverse order.
+   for(MIL_INT i = Tree.NumberOfSubFolders() - 1; i >= 0; i--)
+      {
+      if(!RemoveDirectory((FolderPath + Tree.SubFolder(i)).c_str()))
+         NbFailures++;
+      }
+   if(!RemoveDirectory(FolderPath.c_str()))
+      NbFailures++;
+
+   if(NbFailures > 0)
+      MosPrintf(MIL_TEXT("%d files or folders could not be deleted from %s.\n"), (int)NbFailures, FolderName.c_str());
+   return NbFailures;
+   }
+
+namespace
+   {
+   // Suffix of the output folders that were renamed aside to be deleted.
+   const MIL_TEXT_CHAR OLD_FOLDER_SUFFIX[] = MIL_TEXT("_Old_");
+
+   MIL_STRING RemoveTrailingSeparator(MIL_STRING FolderName)
+      {
+      while(!FolderName.empty() && (FolderName.back() == MIL_TEXT('\\') || FolderName.back() == MIL_TEXT('/')))
+         FolderName.pop_back();
+      return FolderName;
+      }
+   }
+
+// Renames a folder aside, e.g. Dest to Dest_Old_<Process>_<Time>, so that it
+// can be deleted later while a fresh folder takes its place. On a single
+// volume, the rename is atomic and does not depend on the size of the folder.
+bool MoveFolderAside(const MIL_STRING& FolderName, MIL_STRING& AsideFolderName)
+   {
+   MIL_STRING Folder = RemoveTrailingSeparator(FolderName);
+   if(GetFileAttributes(Folder.c_str()) == INVALID_FILE_ATTRIBUTES)
+      return false;
+
+   MIL_TEXT_CHAR Suffix[64];
+   MosSprintf(Suffix, 64, MIL_TEXT("%s%u_%llu"), OLD_FOLDER_SUFFIX, (unsigned int)GetCurrentProcessId(), (unsigned long long)GetTickCount64());
+   AsideFolderName = Folder + Suffix;
+   return MoveFileEx(Folder.c_str(), AsideFolderName.c_str(), 0) != FALSE;
+   }
+
+// Deletes the folders that were renamed aside from an output folder. Returns
+// false if some of them could not be entirely deleted.
+bool CollectOldFolders(const MIL_STRING& FolderName)
+   {
+   MIL_STRING Folder = RemoveTrailingSeparator(FolderName);
+   std::size_t SeparatorPos = Folder.find_last_of(MIL_TEXT("\\/"));
+   MIL_STRING ParentFolder = SeparatorPos == MIL_STRING::npos ? MIL_STRING() : Folder.substr(0, SeparatorPos + 1);
+
+   std::vector<MIL_STRING> OldFolders;
+   WIN32_FIND_DATA FindData;
+   HANDLE FindHandle = FindFirstFile((Folder + OLD_FOLDER_SUFFIX + MIL_TEXT("*")).c_str(), &FindData);
+   if(FindHandle != INVALID_HANDLE_VALUE)
+      {
+      do
+         {
+         if(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            OldFolders.push_back(ParentFolder + FindData.cFileName);
+         } while(FindNextFile(FindHandle, &FindData));
+      FindClose(FindHandle);
+      }
+
+   MIL_INT NbDeleted = 0;
+   for(const auto& OldFolder : OldFolders)
+      {
+      MosPrintf(MIL_TEXT("Deleting %s...\n"), OldFolder.c_str());
+      if(DeleteFolderTree(OldFolder) == 0)
+         NbDeleted++;
+      }
+   MosPrintf(MIL_TEXT("%d of %d old output folder(s) deleted.\n"), (int)NbDeleted, (int)OldFolders.size());
+   return NbDeleted == (MIL_INT)OldFolders.size();
    }
 
 // Create the required directories.
-void PrepareExampleDataFolder(const MIL_ID MilApplication, const MIL_STRING& ExampleDataPath, const MIL_STRING* ClassName, MIL_INT NumberOfClasses)
+void PrepareExampleDataFolder(const MIL_STRING& ExampleDataPath, const MIL_STRING* ClassName, MIL_INT NumberOfClasses, MIL_INT FanOut, bool DeleteExistingFiles)
    {
    MIL_INT FileExists;
    MappFileOperation(M_DEFAULT, ExampleDataPath, M_NULL, M_NULL, M_FILE_EXISTS, M_DEFAULT, &FileExists);
@@ -611,6 +1185,16 @@ void PrepareExampleDataFolder(const MIL_ID MilApplication, const MIL_STRING& Exa
          }
       MosPrintf(MIL_TEXT("\n"));
       }
+   else if(!DeleteExistingFiles)
+      {
+      // The folder is shared with other processes; only create what is missing.
+      for(MIL_INT i = 0; i < NumberOfClasses; i++)
+         {
+         MappFileOperation(M_DEFAULT, ExampleDataPath + ClassName[i], M_NULL, M_NULL, M_FILE_EXISTS, M_DEFAULT, &FileExists);
+         if(FileExists != M_YES)
+            MappFileOperation(M_DEFAULT, ExampleDataPath + ClassName[i], M_NULL, M_NULL, M_FILE_MAKE_DIR, M_DEFAULT, M_NULL);
+         }
+      }
    else
       {
       // If ExampleDataPath folder is existing, delete files already in there
@@ -623,128 +1207,340 @@ void PrepareExampleDataFolder(const MIL_ID MilApplication, const MIL_STRING& Exa
 
          MappFileOperation(M_DEFAULT, ExampleDataPath + ClassName[i], M_NULL, M_NULL, M_FILE_EXISTS, M_DEFAULT, &FileExists);
          if(FileExists)
-            DeleteFilesInFolder(MilApplication, ExampleDataPath + ClassName[i] + MIL_TEXT("/"));
+            DeleteFilesInFolder(ExampleDataPath + ClassName[i] + MIL_TEXT("/"));
          else
             MappFileOperation(M_DEFAULT, ExampleDataPath + ClassName[i], M_NULL, M_NULL, M_FILE_MAKE_DIR, M_DEFAULT, M_NULL);
          }
       MosPrintf(MIL_TEXT("\n"));
       }
+
+   // Create the fan-out subfolders up front, so that saving a tile never has
+   // to create a folder. The existing ones are left as they are.
+   for(MIL_INT i = 0; i < NumberOfClasses && FanOut > 0; i++)
+      {
+      for(MIL_INT Bucket = 0; Bucket < FanOut; Bucket++)
+         CreateDirectory((ExampleDataPath + ClassName[i] + MIL_TEXT("\\") + CTilePathBuilder::FanOutFolderName(Bucket, FanOut)).c_str(), NULL);
+      }
    }
 
-void AddFolderToDataset(const MIL_ID MilApplication, const MIL_STRING& DataPath, MIL_ID Dataset)
+void AddSourceToDataset(CImageSource& Source, MIL_ID Dataset)
    {
-   MIL_INT NbEntries;
-   MclassInquire(Dataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &NbEntries);
-
-   std::vector<MIL_STRING> FilesInFolder;
-   ListFilesInFolder(MilApplication, DataPath, FilesInFolder);
+   std::vector<MIL_STRING> SourceImages;
+   Source.ListImages(SourceImages);
+
+   CEntryTable NewEntries;
+   NewEntries.Reserve((MIL_INT)SourceImages.size());
+   for(std::size_t i = 0; i < SourceImages.size(); i++)
+      NewEntries.AddEntry(SourceImages[i], 0, (MIL_INT)i);
+   NewEntries.CommitToDataset(Dataset);
+   }
 
-   MIL_INT CurImageIndex = 0;
-   for(const auto& File : FilesInFolder)
+// Saves an extracted tile and adds it to the entries. With DirectCrop, only the
+// centered TileImageSize part of the tile is saved, so it does not need to be
+// cropped later, and the full tile, with its overscan, is augmented right away.
+void SaveExtractedTile(MIL_ID TileImage,
+                       const MIL_STRING& TileFileName,
+                       MIL_INT ClassIndex,
+                       MIL_INT SourceIndex,
+                       MIL_INT OffsetX,
+                       MIL_INT OffsetY,
+                       const SDataPrepConfig& Config,
+                       CTileAugmenter* Augmenter,
+                       CTileWriter& Writer,
+                       CEntryTable& DestEntries)
+   {
+   MIL_INT TileSize = MbufInquire(TileImage, M_SIZE_X, M_NULL);
+   MIL_INT Entry;
+   if(Config.DirectCrop)
       {
-      MIL_STRING fileLocalPath = File.substr(DataPath.length());
-      MclassControl(Dataset, M_DEFAULT, M_ENTRY_ADD, M_DEFAULT);
-      MclassControlEntry(Dataset, NbEntries + CurImageIndex, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, M_DEFAULT, fileLocalPath, M_DEFAULT);
-      MclassControlEntry(Dataset, NbEntries + CurImageIndex, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH, 0, M_NULL, M_DEFAULT);
-      CurImageIndex++;
+      MIL_INT CropOffset = (TileSize - Config.TileImageSize) / 2;
+      auto CroppedTile = MbufChild2d(TileImage, CropOffset, CropOffset, Config.TileImageSize, Config.TileImageSize, M_UNIQUE_ID);
+      Writer.Save(CroppedTile, TileFileName);
+      Entry = DestEntries.AddEntry(TileFileName, ClassIndex, SourceIndex, OffsetX, OffsetY,
+                                   CEntryTable::NO_AUGMENTATION_SOURCE, 0, Config.TileImageSize);
       }
+   else
+      {
+      Writer.Save(TileImage, TileFileName);
+      Entry = DestEntries.AddEntry(TileFileName, ClassIndex, SourceIndex, OffsetX, OffsetY,
+                                   CEntryTable::NO_AUGMENTATION_SOURCE, 0, TileSize);
+      }
+
+   if(Augmenter)
+      Augmenter->AugmentTile(TileImage, Entry, DestEntries);
    }
 
-void AugmentDataset(MIL_ID System, MIL_ID Dataset, const MIL_INT* NbAugmentPerImage)
+CTileAugmenter::CTileAugmenter(MIL_ID System, const MIL_INT* NbAugmentPerImage, MIL_INT FinalImageSize, unsigned int Seed, CTileWriter& Writer)
+   : m_System(System),
+     m_NbAugmentPerImage(NbAugmentPerImage),
+     m_FinalImageSize(FinalImageSize),
+     m_Seed(Seed),
+     m_Writer(Writer)
    {
-   auto AugmentContext = MimAlloc(System, M_AUGMENTATION_CONTEXT, M_DEFAULT, M_UNIQUE_ID);
-   auto AugmentResult = MimAllocResult(System, M_DEFAULT, M_AUGMENTATION_RESULT, M_UNIQUE_ID);
+   m_AugmentContext = MimAlloc(System, M_AUGMENTATION_CONTEXT, M_DEFAULT, M_UNIQUE_ID);
 
    // Seed the augmentation to ensure repeatability.
-   MimControl(AugmentContext, M_AUG_SEED_MODE, M_RNG_INIT_VALUE);
-   MimControl(AugmentContext, M_AUG_RNG_INIT_VALUE, 42);
-
-   MimControl(AugmentContext, M_AUG_TRANSLATION_X_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_TRANSLATION_Y_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_TRANSLATION_X_OP_MAX, 5);
-   MimControl(AugmentContext, M_AUG_TRANSLATION_Y_OP_MAX, 5);
-
-   MimControl(AugmentContext, M_AUG_SCALE_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_SCALE_OP_FACTOR_MIN, 0.95);
-   MimControl(AugmentContext, M_AUG_SCALE_OP_FACTOR_MAX, 1.05);
-
-   MimControl(AugmentContext, M_AUG_ASPECT_RATIO_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_ASPECT_RATIO_OP + M_PROBABILITY, 75);
-   MimControl(AugmentContext, M_AUG_ASPECT_RATIO_OP_MODE, M_BOTH);
-   MimControl(AugmentContext, M_AUG_ASPECT_RATIO_OP_MIN, 0.95);
-   MimControl(AugmentContext, M_AUG_ASPECT_RATIO_OP_MAX, 1.05);
+   MimControl(m_AugmentContext, M_AUG_SEED_MODE, M_RNG_INIT_VALUE);
+   MimControl(m_AugmentContext, M_AUG_RNG_INIT_VALUE, (MIL_INT)Seed);
+
+   MimControl(m_AugmentContext, M_AUG_TRANSLATION_X_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_TRANSLATION_Y_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_TRANSLATION_X_OP_MAX, 5);
+   MimControl(m_AugmentContext, M_AUG_TRANSLATION_Y_OP_MAX, 5);
+
+   MimControl(m_AugmentContext, M_AUG_SCALE_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_SCALE_OP_FACTOR_MIN, 0.95);
+   MimControl(m_AugmentContext, M_AUG_SCALE_OP_FACTOR_MAX, 1.05);
+
+   MimControl(m_AugmentContext, M_AUG_ASPECT_RATIO_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_ASPECT_RATIO_OP + M_PROBABILITY, 75);
+   MimControl(m_AugmentContext, M_AUG_ASPECT_RATIO_OP_MODE, M_BOTH);
+   MimControl(m_AugmentContext, M_AUG_ASPECT_RATIO_OP_MIN, 0.95);
+   MimControl(m_AugmentContext, M_AUG_ASPECT_RATIO_OP_MAX, 1.05);
+
+   MimControl(m_AugmentContext, M_AUG_ROTATION_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_ROTATION_OP_ANGLE_DELTA, 5.0);
+
+   MimControl(m_AugmentContext, M_AUG_FLIP_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_FLIP_OP + M_PROBABILITY, 70);
+   MimControl(m_AugmentContext, M_AUG_FLIP_OP_DIRECTION, M_BOTH);
+
+   MimControl(m_AugmentContext, M_AUG_INTENSITY_ADD_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_INTENSITY_ADD_OP_MODE, M_LUMINANCE);
+   MimControl(m_AugmentContext, M_AUG_INTENSITY_ADD_OP_DELTA, 30.0);
+
+   MimControl(m_AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP, M_ENABLE);
+   MimControl(m_AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP + M_PROBABILITY, 25);
+   MimControl(m_AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP_STDDEV, 0.005);
+   MimControl(m_AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP_STDDEV_DELTA, 0.005);
+   }
 
-   MimControl(AugmentContext, M_AUG_ROTATION_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_ROTATION_OP_ANGLE_DELTA, 5.0);
+void CTileAugmenter::AugmentTile(MIL_ID TileImage, MIL_INT SourceEntry, CEntryTable& Entries)
+   {
+   MIL_INT GroundTruthIndex = Entries.ClassIndex(SourceEntry);
+   if(m_NbAugmentPerImage[GroundTruthIndex] <= 0)
+      return;
+
+   // The path is only used before any entry is appended, since appending can
+   // move the storage of the table.
+   const MIL_TEXT_CHAR* FilePath = Entries.FilePath(SourceEntry);
+   m_PathBuilder.SetSource(FilePath);
+
+   // Re-seed the augmentation for each tile so that its augmentations do not
+   // depend on the order, or the shard, in which the tiles are processed. The
+   // seed comes from the name of the tile without its folders and extension,
+   // so that it does not change with the folder or the format of the tiles.
+   std::size_t PathLength = Entries.FilePathLength(SourceEntry);
+   std::size_t NameStart = 0;
+   std::size_t NameEnd = PathLength;
+   for(std::size_t i = 0; i < PathLength; i++)
+      {
+      if(FilePath[i] == MIL_TEXT('\\') || FilePath[i] == MIL_TEXT('/'))
+         {
+         NameStart = i + 1;
+         NameEnd = PathLength;
+         }
+      else if(FilePath[i] == MIL_TEXT('.'))
+         NameEnd = i;
+      }
+   MIL_UINT32 AugmentationSeed = (MIL_UINT32)(HashChars(FilePath + NameStart, NameEnd - NameStart, m_Seed) & 0x7FFFFFFF);
+   MimControl(m_AugmentContext, M_AUG_RNG_INIT_VALUE, AugmentationSeed);
+
+   // The augmented image buffer, and its centered child, are reused as long as
+   // the tiles keep the same format. A tile that is already smaller than the
+   // final size is saved whole.
+   MIL_INT SizeX = MbufInquire(TileImage, M_SIZE_X, M_NULL);
+   MIL_INT SizeY = MbufInquire(TileImage, M_SIZE_Y, M_NULL);
+   MIL_INT SizeBand = MbufInquire(TileImage, M_SIZE_BAND, M_NULL);
+   if(!m_AugmentedImage ||
+      MbufInquire(m_AugmentedImage, M_SIZE_X, M_NULL) != SizeX ||
+      MbufInquire(m_AugmentedImage, M_SIZE_Y, M_NULL) != SizeY ||
+      MbufInquire(m_AugmentedImage, M_SIZE_BAND, M_NULL) != SizeBand)
+      {
+      m_AugmentedCrop.reset();
+      m_AugmentedImage = MbufClone(TileImage, m_System, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
 
-   MimControl(AugmentContext, M_AUG_FLIP_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_FLIP_OP + M_PROBABILITY, 70);
-   MimControl(AugmentContext, M_AUG_FLIP_OP_DIRECTION, M_BOTH);
+      if(SizeX >= m_FinalImageSize && SizeY >= m_FinalImageSize)
+         {
+         m_AugmentedCrop = MbufChild2d(m_AugmentedImage, (SizeX - m_FinalImageSize) / 2, (SizeY - m_FinalImageSize) / 2,
+                                       m_FinalImageSize, m_FinalImageSize, M_UNIQUE_ID);
+         m_AugmentedCropSize = m_FinalImageSize;
+         }
+      else
+         {
+         m_AugmentedCropSize = SizeX;
+         }
+      }
+   MIL_ID SavedImage = m_AugmentedCrop ? m_AugmentedCrop.get() : m_AugmentedImage.get();
 
-   MimControl(AugmentContext, M_AUG_INTENSITY_ADD_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_INTENSITY_ADD_OP_MODE, M_LUMINANCE);
-   MimControl(AugmentContext, M_AUG_INTENSITY_ADD_OP_DELTA, 30.0);
+   MIL_INT SourceIndex = Entries.SourceIndex(SourceEntry);
+   MIL_INT OffsetX = Entries.OffsetX(SourceEntry);
+   MIL_INT OffsetY = Entries.OffsetY(SourceEntry);
+   for(MIL_INT AugIndex = 0; AugIndex < m_NbAugmentPerImage[GroundTruthIndex]; AugIndex++)
+      {
+      MbufClear(m_AugmentedImage, 0.0);
+      MimAugment(m_AugmentContext, TileImage, m_AugmentedImage, M_DEFAULT, M_DEFAULT);
 
-   MimControl(AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP, M_ENABLE);
-   MimControl(AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP + M_PROBABILITY, 25);
-   MimControl(AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP_STDDEV, 0.005);
-   MimControl(AugmentContext, M_AUG_NOISE_GAUSSIAN_ADDITIVE_OP_STDDEV_DELTA, 0.005);
+      const MIL_STRING& AugFileName = m_PathBuilder.Build(0, MIL_TEXT("_Aug_"), AugIndex, -1, 1);
+      m_Writer.Save(SavedImage, AugFileName);
 
-   MIL_INT NbEntries = 0;
-   MclassInquire(Dataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &NbEntries);
+      // Add the augmented image. Its augmentation source identifies the fact
+      // that this is augmented data in case we want to use this dataset later.
+      Entries.AddEntry(AugFileName, GroundTruthIndex, SourceIndex, OffsetX, OffsetY, SourceEntry, AugmentationSeed, m_AugmentedCropSize);
+      }
+   }
 
-   MIL_INT PosInAugmentDataset = NbEntries;
+void AugmentDataset(MIL_ID System, CEntryTable& Entries, const MIL_INT* NbAugmentPerImage, MIL_INT FinalImageSize, unsigned int Seed, CTileWriter& Writer)
+   {
+   CTileAugmenter Augmenter(System, NbAugmentPerImage, FinalImageSize, Seed, Writer);
 
+   // The augmented images are appended after all the existing entries.
+   MIL_INT NbEntries = Entries.NumberOfEntries();
    for(MIL_INT i = 0; i < NbEntries; i++)
       {
       MosPrintf(MIL_TEXT("   %d of %d completed\r"), i + 1, NbEntries);
 
-      MIL_STRING FilePath;
-      MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FilePath);
-      MIL_INT GroundTruthIndex;
-      MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH + M_TYPE_MIL_INT, &GroundTruthIndex);
-
-      // Add the augmentations.
-      MIL_UNIQUE_BUF_ID OrginalImage = MbufRestore(FilePath, System, M_UNIQUE_ID);
-      MIL_UNIQUE_BUF_ID AugmentedImage = MbufClone(OrginalImage, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
-      for(MIL_INT AugIndex = 0; AugIndex < NbAugmentPerImage[GroundTruthIndex]; AugIndex++)
-         {
-         MbufClear(AugmentedImage, 0.0);
-         MimAugment(AugmentContext, OrginalImage, AugmentedImage, M_DEFAULT, M_DEFAULT);
-
-         MIL_TEXT_CHAR Suffix[128];
-         MosSprintf(Suffix, 128, MIL_TEXT("_Aug_%d"), AugIndex);
+      if(NbAugmentPerImage[Entries.ClassIndex(i)] <= 0)
+         continue;
 
-         MIL_STRING AugFileName = FilePath;
-         std::size_t DotPos = AugFileName.rfind(MIL_TEXT("."));
-         AugFileName.insert(DotPos, Suffix);
-         MbufSave(AugFileName, AugmentedImage);
+      MIL_UNIQUE_BUF_ID OrginalImage = MbufRestore(Entries.FilePath(i), System, M_UNIQUE_ID);
+      Augmenter.AugmentTile(OrginalImage, i, Entries);
+      }
+   MosPrintf(MIL_TEXT("\n"));
+   }
 
-         // Add the augmented image.
-         MclassControl(Dataset, M_DEFAULT, M_ENTRY_ADD, M_DEFAULT);
-         MclassControlEntry(Dataset, PosInAugmentDataset, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH, GroundTruthIndex, M_NULL, M_DEFAULT);
-         MclassControlEntry(Dataset, PosInAugmentDataset, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, M_DEFAULT, AugFileName, M_DEFAULT);
+CTileHashIndex::CTileHashIndex(MIL_ID System, MIL_INT MaxDistance)
+   : m_System(System),
+     m_MaxDistance(MaxDistance),
+     m_NbBands(MaxDistance + 1)
+   {
+   }
 
-         // Identify the fact that this is augmented data in case we want to use this dataset later.
-         MclassControlEntry(Dataset, PosInAugmentDataset, M_DEFAULT_KEY, M_DEFAULT, M_AUGMENTATION_SOURCE, i, M_NULL, M_DEFAULT);
+bool CTileHashIndex::AddTile(MIL_ID TileImage, MIL_INT SourceIndex, MIL_INT ClassIndex, MIL_INT OffsetX, MIL_INT OffsetY)
+   {
+   // The tile is reduced to 8x8 by averaging, in a thumbnail reused as long
+   // as the tiles keep the same number of bands.
+   MIL_INT SizeBand = MbufInquire(TileImage, M_SIZE_BAND, M_NULL);
+   if(!m_Thumbnail || MbufInquire(m_Thumbnail, M_SIZE_BAND, M_NULL) != SizeBand)
+      {
+      m_Thumbnail = MbufAllocColor(m_System, SizeBand, 8, 8, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+      m_ThumbnailPixels.resize((std::size_t)(SizeBand * 64));
+      }
+   MimResize(TileImage, m_Thumbnail, M_FILL_DESTINATION, M_FILL_DESTINATION, M_AVERAGE);
+   MbufGetColor(m_Thumbnail, M_PLANAR, M_ALL_BANDS, m_ThumbnailPixels.data());
+
+   SIndexedTile NewTile;
+   NewTile.Hash        = ComputeAverageHash(m_ThumbnailPixels.data(), SizeBand);
+   NewTile.SourceIndex = (MIL_INT32)SourceIndex;
+   NewTile.ClassIndex  = (MIL_INT32)ClassIndex;
+   NewTile.OffsetX     = (MIL_INT32)OffsetX;
+   NewTile.OffsetY     = (MIL_INT32)OffsetY;
+   NewTile.SizeX       = (MIL_INT32)MbufInquire(TileImage, M_SIZE_X, M_NULL);
+   NewTile.SizeY       = (MIL_INT32)MbufInquire(TileImage, M_SIZE_Y, M_NULL);
+
+   // Only the tiles that share a band of the hash are compared.
+   for(MIL_INT BandIndex = 0; BandIndex < m_NbBands; BandIndex++)
+      {
+      auto Bucket = m_Buckets.find(BucketKey(SourceIndex, BandIndex, NewTile.Hash));
+      if(Bucket == m_Buckets.end())
+         continue;
 
-         PosInAugmentDataset++;
+      for(MIL_UINT32 TileIndex : Bucket->second)
+         {
+         const SIndexedTile& Tile = m_Tiles[TileIndex];
+         bool Overlaps = std::abs(Tile.OffsetX - NewTile.OffsetX) < std::min(Tile.SizeX, NewTile.SizeX) &&
+                         std::abs(Tile.OffsetY - NewTile.OffsetY) < std::min(Tile.SizeY, NewTile.SizeY);
+         if(Tile.SourceIndex == NewTile.SourceIndex && Tile.ClassIndex == NewTile.ClassIndex && Overlaps &&
+            (MIL_INT)std::bitset<64>(Tile.Hash ^ NewTile.Hash).count() <= m_MaxDistance)
+            {
+            m_NbDropped++;
+            return false;
+            }
          }
       }
-   MosPrintf(MIL_TEXT("\n"));
+
+   MIL_UINT32 NewIndex = (MIL_UINT32)m_Tiles.size();
+   m_Tiles.push_back(NewTile);
+   for(MIL_INT BandIndex = 0; BandIndex < m_NbBands; BandIndex++)
+      m_Buckets[BucketKey(SourceIndex, BandIndex, NewTile.Hash)].push_back(NewIndex);
+   return true;
    }
 
-void CropDatasetImages(MIL_ID MilSystem, MIL_ID Dataset, MIL_INT FinalImageSize)
+MIL_UINT64 CTileHashIndex::ComputeAverageHash(const MIL_UINT8* Thumbnail, MIL_INT NbBands)
    {
-   MIL_INT NbEntries;
-   MclassInquire(Dataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &NbEntries);
+   MIL_INT Sums[64];
+   MIL_INT Total = 0;
+   for(MIL_INT i = 0; i < 64; i++)
+      {
+      Sums[i] = 0;
+      for(MIL_INT b = 0; b < NbBands; b++)
+         Sums[i] += Thumbnail[b * 64 + i];
+      Total += Sums[i];
+      }
+
+   // Compared with the mean without dividing: Sum > Total / 64.
+   MIL_UINT64 Hash = 0;
+   for(MIL_INT i = 0; i < 64; i++)
+      {
+      if(Sums[i] * 64 > Total)
+         Hash |= 1ULL << i;
+      }
+   return Hash;
+   }
+
+// The buckets of all the bands and source images share the same map; a
+// collision of keys only adds a candidate that is then rejected. The source
+// index and the band index are mixed in turn before the bits of the band,
+// which can take all the 64 bits when there is a single band.
+MIL_UINT64 CTileHashIndex::BucketKey(MIL_INT SourceIndex, MIL_INT BandIndex, MIL_UINT64 Hash) const
+   {
+   MIL_INT FirstBit = BandIndex * 64 / m_NbBands;
+   MIL_INT NbBits = (BandIndex + 1) * 64 / m_NbBands - FirstBit;
+   MIL_UINT64 BandBits = (Hash >> FirstBit) & (NbBits == 64 ? ~0ULL : (1ULL << NbBits) - 1);
+   MIL_UINT64 Key = MixHash((MIL_UINT64)SourceIndex);
+   Key = MixHash(Key ^ (MIL_UINT64)BandIndex);
+   return MixHash(Key ^ BandBits);
+   }
+
+void CropDatasetImages(MIL_ID MilSystem, const CEntryTable& Entries, MIL_INT FinalImageSize, CTileWriter& Writer)
+   {
+   MIL_INT NbEntries = Entries.NumberOfEntries();
+   CMappedFile TileFile;
+   SRasterImage TileRaster;
+   std::vector<MIL_UINT8> CroppedPlanes;
+   MIL_UNIQUE_BUF_ID CroppedTile;
+   const DeinterleaveRowFunction DeinterleaveRow = SelectDeinterleaveRow(FinalImageSize);
 
    for(MIL_INT i = 0; i < NbEntries; i++)
       {
       MosPrintf(MIL_TEXT("   %d of %d completed\r"), i + 1, NbEntries);
 
-      MIL_STRING FilePath;
-      MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FilePath);
+      // The tiles that were saved at their final size do not need to be cropped.
+      if(Entries.ImageSize(i) == FinalImageSize)
+         continue;
+
+      const MIL_TEXT_CHAR* FilePath = Entries.FilePath(i);
+
+      // The uncompressed tiles are cropped from their mapped rows, with the
+      // kernel of the final size, into a reused buffer. The file is unmapped
+      // before the cropped tile overwrites it.
+      if(TileFile.Open(FilePath) && ParseRasterImage(TileFile.Data(), TileFile.Size(), TileRaster) &&
+         TileRaster.SizeX >= FinalImageSize && TileRaster.SizeY >= FinalImageSize)
+         {
+         CopyRasterTile(TileRaster, (TileRaster.SizeX - FinalImageSize) / 2, (TileRaster.SizeY - FinalImageSize) / 2,
+                        FinalImageSize, FinalImageSize, DeinterleaveRow, CroppedPlanes);
+         TileFile.Close();
+
+         if(!CroppedTile || MbufInquire(CroppedTile, M_SIZE_BAND, M_NULL) != TileRaster.SizeBand)
+            CroppedTile = MbufAllocColor(MilSystem, TileRaster.SizeBand, FinalImageSize, FinalImageSize, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+         if(TileRaster.SizeBand == 1)
+            MbufPut2d(CroppedTile, 0, 0, FinalImageSize, FinalImageSize, CroppedPlanes.data());
+         else
+            MbufPutColor2d(CroppedTile, M_PLANAR, M_ALL_BANDS, 0, 0, FinalImageSize, FinalImageSize, CroppedPlanes.data());
+         Writer.Save(CroppedTile, FilePath);
+         continue;
+         }
+      TileFile.Close();
 
       MIL_UNIQUE_BUF_ID OriginalImage = MbufRestore(FilePath, MilSystem, M_UNIQUE_ID);
 
@@ -759,8 +1555,232 @@ void CropDatasetImages(MIL_ID MilSystem, MIL_ID Dataset, MIL_INT FinalImageSize)
 
       MbufCopyColor2d(OriginalImage, CroppedImage, M_ALL_BANDS, OffsetX, OffsetY, M_ALL_BANDS, 0, 0, FinalImageSize, FinalImageSize);
 
-      MbufSave(FilePath, CroppedImage);
+      Writer.Save(CroppedImage, FilePath);
       }
 
    MosPrintf(MIL_TEXT("\n"));
    }
+
+// ===========================================================================
+// Run-time parameters.
+// ===========================================================================
+
+// Converts a value of the label image to the index of its class. Unknown
+// values are considered as background.
+MIL_INT LabelValueToClassIndex(const SDataPrepConfig& Config, MIL_DOUBLE LabelValue)
+   {
+   for(MIL_INT i = 0; i < Config.NumberOfClasses(); i++)
+      {
+      if(Config.ClassLabelValues[i] == (MIL_INT)LabelValue)
+         return i;
+      }
+   return 0;
+   }
+
+// ===========================================================================
+// Distributed execution.
+// ===========================================================================
+
+// Returns the name of the partial dataset of a shard, e.g.
+// TrainDataset.mclassd -> TrainDataset_Shard003of016.mclassd.
+MIL_STRING GetShardDatasetFile(const MIL_STRING& DatasetFile, MIL_INT ShardIndex, MIL_INT ShardCount)
+   {
+   MIL_TEXT_CHAR Suffix[64];
+   MosSprintf(Suffix, 64, MIL_TEXT("_Shard%03dof%03d"), (int)ShardIndex, (int)ShardCount);
+
+   MIL_STRING ShardFile = DatasetFile;
+   std::size_t DotPos = ShardFile.rfind(MIL_TEXT("."));
+   ShardFile.insert(DotPos == MIL_STRING::npos ? ShardFile.size() : DotPos, Suffix);
+   return ShardFile;
+   }
+
+// Finds the position of each image in the listing dataset.
+void GetListingIndices(MIL_ID ListingDataset, std::map<MIL_STRING, MIL_INT>& ListingIndices)
+   {
+   MIL_INT NbEntries;
+   MclassInquire(ListingDataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &NbEntries);
+
+   for(MIL_INT i = 0; i < NbEntries; i++)
+      {
+      MIL_STRING FilePath;
+      MclassInquireEntry(ListingDataset, i, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FilePath);
+      ListingIndices[FilePath] = i;
+      }
+   }
+
+// Keeps the source images of one shard. The images are dealt in turn to the
+// shards in the order of the listing, so that each shard gets the same amount
+// of work and the shard of an image does not depend on its train/dev side.
+void SelectShardEntries(const CEntryTable& SourceImages, MIL_INT ShardIndex, MIL_INT ShardCount, CEntryTable& ShardImages)
+   {
+   for(MIL_INT i = 0; i < SourceImages.NumberOfEntries(); i++)
+      {
+      if(SourceImages.SourceIndex(i) % ShardCount == ShardIndex)
+         ShardImages.AddEntry(SourceImages.FilePath(i), SourceImages.FilePathLength(i), SourceImages.ClassIndex(i), SourceImages.SourceIndex(i));
+      }
+   }
+
+// Decides whether a source image goes to the train dataset, from the hash of
+// its name mapped to [0, 100).
+bool IsTrainSourceImage(const MIL_STRING& FileName, MIL_DOUBLE PercentageInTrain, unsigned int Seed)
+   {
+   MIL_UINT64 Hash = MixHash(HashString(FileName, Seed));
+   return (MIL_DOUBLE)(Hash >> 11) * (100.0 / 9007199254740992.0) < PercentageInTrain;
+   }
+
+// Returns the shard of a source image. It hashes with another seed than the
+// split, so that the shard of an image does not depend on its train/dev side.
+MIL_INT GetSourceImageShard(const MIL_STRING& FileName, MIL_INT ShardCount, unsigned int Seed)
+   {
+   return (MIL_INT)(MixHash(HashString(FileName, (MIL_UINT64)Seed + 1)) % (MIL_UINT64)ShardCount);
+   }
+
+// Splits the source images to train/dev one by one, from the hash of their
+// split key (their name, or their group), keeping only those of the shard of
+// the process. The shards are chosen from the names, so that a large group is
+// still spread over the shards. The source index is the position in the listing.
+void SplitSourceImagesByHash(const std::vector<MIL_STRING>& SourceImages,
+                             const std::vector<MIL_STRING>& SplitKeys,
+                             const SDataPrepConfig& Config,
+                             CEntryTable& TrainImages,
+                             CEntryTable& DevImages)
+   {
+   for(std::size_t i = 0; i < SourceImages.size(); i++)
+      {
+      const MIL_STRING& FileName = SourceImages[i];
+      if(Config.ShardCount > 1 && GetSourceImageShard(FileName, Config.ShardCount, Config.SplitSeed) != Config.ShardIndex)
+         continue;
+
+      if(IsTrainSourceImage(SplitKeys[i], Config.PercentageInTrainDataset, Config.SplitSeed))
+         TrainImages.AddEntry(FileName, 0, (MIL_INT)i);
+      else
+         DevImages.AddEntry(FileName, 0, (MIL_INT)i);
+      }
+   }
+
+// Finds the group of each source image: the one given by the source, else the
+// part of the name matched by the pattern, else the name itself. The groups
+// are prefixed by their origin so that a group name cannot collide with an
+// image name. Returns the number of distinct groups.
+MIL_INT GetSourceImageGroups(CImageSource& Source,
+                             const std::vector<MIL_STRING>& SourceImages,
+                             const MIL_STRING& GroupPattern,
+                             std::vector<MIL_STRING>& Groups)
+   {
+   std::basic_regex<MIL_TEXT_CHAR> GroupRegex;
+   if(!GroupPattern.empty())
+      GroupRegex.assign(GroupPattern);
+
+   Groups.resize(SourceImages.size());
+   std::unordered_set<MIL_STRING> DistinctGroups;
+   std::match_results<MIL_STRING::const_iterator> Match;
+   for(std::size_t i = 0; i < SourceImages.size(); i++)
+      {
+      const MIL_STRING& FileName = SourceImages[i];
+      MIL_STRING& Group = Groups[i];
+      if(Source.GetImageGroup(FileName, Group))
+         Group.insert(0, MIL_TEXT("group:"));
+      else if(!GroupPattern.empty() && std::regex_search(FileName, Match, GroupRegex))
+         Group = MIL_TEXT("group:") + (Match.size() > 1 && Match[1].matched ? Match[1].str() : Match[0].str());
+      else
+         Group = MIL_TEXT("image:") + FileName;
+      DistinctGroups.insert(Group);
+      }
+   return (MIL_INT)DistinctGroups.size();
+   }
+
+// Merges the partial datasets saved by the shards into the final datasets.
+bool MergeShardDatasets(MIL_ID MilSystem, const SDataPrepConfig& Config)
+   {
+   const MIL_STRING* DatasetFiles[2] = {&Config.TrainDatasetFile, &Config.DevDatasetFile};
+   for(const MIL_STRING* DatasetFile : DatasetFiles)
+      {
+      MosPrintf(MIL_TEXT("\nMerging %d shards into %s...\n"), (int)Config.MergeShardCount, DatasetFile->c_str());
+
+      MIL_UNIQUE_CLASS_ID MergedDataset = MclassAlloc(MilSystem, M_DATASET_IMAGES, M_DEFAULT, M_UNIQUE_ID);
+      MclassControl(MergedDataset, M_CONTEXT, M_ROOT_PATH, GetExampleCurrentDirectory());
+
+      CEntryTable MergedEntries;
+      for(MIL_INT ShardIndex = 0; ShardIndex < Config.MergeShardCount; ShardIndex++)
+         {
+         MosPrintf(MIL_TEXT("   %d of %d completed\r"), (int)ShardIndex + 1, (int)Config.MergeShardCount);
+
+         MIL_STRING ShardFile = GetShardDatasetFile(*DatasetFile, ShardIndex, Config.MergeShardCount);
+         MIL_INT FileExists;
+         MappFileOperation(M_DEFAULT, ShardFile, M_NULL, M_NULL, M_FILE_EXISTS, M_DEFAULT, &FileExists);
+         if(FileExists != M_YES)
+            {
+            MosPrintf(MIL_TEXT("\nThe partial dataset %s is missing.\n"), ShardFile.c_str());
+            return false;
+            }
+
+         MIL_UNIQUE_CLASS_ID ShardDataset = MclassRestore(ShardFile, MilSystem, M_DEFAULT, M_UNIQUE_ID);
+         if(ShardIndex == 0)
+            MclassCopy(ShardDataset, M_DEFAULT, MergedDataset, M_DEFAULT, M_CLASS_DEFINITIONS, M_DEFAULT);
+
+         CEntryTable ShardEntries;
+         ShardEntries.LoadFromDataset(ShardDataset);
+         MergedEntries.Append(ShardEntries);
+         }
+
+      MergedEntries.CommitToDataset(MergedDataset);
+      MclassSave(*DatasetFile, MergedDataset, M_DEFAULT);
+      MosPrintf(MIL_TEXT("\n"));
+      }
+
+   return true;
+   }
+
+// ===========================================================================
+// Source images.
+// ===========================================================================
+
+void BenchmarkTileCopy(MIL_ID MilSystem, CImageSource& Source, const MIL_STRING& FileName, MIL_INT TileSize, unsigned int Seed)
+   {
+   const MIL_INT NB_TILES = 5000;
+
+   MosPrintf(MIL_TEXT("Benchmarking the tile copies on %s...\n"), FileName.c_str());
+   Source.SetMapFiles(true);
+   CImageBandReader Reader;
+   if(!Source.OpenImage(MilSystem, FileName, Reader) || !Reader.IsMapped())
+      {
+      MosPrintf(MIL_TEXT("The image is not an uncompressed TIFF or BMP file.\n"));
+      return;
+      }
+   // The offsets are drawn in [0, ImageSize - TileSize).
+   if(!CheckTileFits(FileName, Reader.SizeX(), Reader.SizeY(), TileSize, TileSize, 1))
+      return;
+
+   // Both copies cut the same tiles, from the whole image.
+   std::mt19937 Generator(Seed);
+   std::vector<MIL_INT> OffsetsX(NB_TILES), OffsetsY(NB_TILES);
+   for(MIL_INT i = 0; i < NB_TILES; i++)
+      {
+      OffsetsX[i] = (MIL_INT)(Generator() % (Reader.SizeX() - TileSize));
+      OffsetsY[i] = (MIL_INT)(Generator() % (Reader.SizeY() - TileSize));
+      }
+   MIL_ID Image = Reader.ReadBand(0, Reader.SizeY());
+   auto MilTile = MbufAllocColor(MilSystem, Reader.SizeBand(), TileSize, TileSize, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+   auto RowsTile = MbufAllocColor(MilSystem, Reader.SizeBand(), TileSize, TileSize, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+
+   MIL_DOUBLE StartTime, MilTime, RowsTime;
+   MappTimer(M_DEFAULT, M_TIMER_READ, &StartTime);
+   for(MIL_INT i = 0; i < NB_TILES; i++)
+      MbufCopyColor2d(Image, MilTile, M_ALL_BANDS, OffsetsX[i], OffsetsY[i], M_ALL_BANDS, 0, 0, TileSize, TileSize);
+   MappTimer(M_DEFAULT, M_TIMER_READ, &MilTime);
+   for(MIL_INT i = 0; i < NB_TILES; i++)
+      Reader.CopyTile(OffsetsX[i], OffsetsY[i], RowsTile);
+   MappTimer(M_DEFAULT, M_TIMER_READ, &RowsTime);
+   RowsTime -= MilTime;
+   MilTime -= StartTime;
+
+   // The last tiles of both copies must be identical.
+   std::vector<MIL_UINT8> MilPixels((std::size_t)(TileSize * TileSize * Reader.SizeBand()));
+   std::vector<MIL_UINT8> RowsPixels(MilPixels.size());
+   MbufGetColor(MilTile, M_PLANAR, M_ALL_BANDS, MilPixels.data());
+   MbufGetColor(RowsTile, M_PLANAR, M_ALL_BANDS, RowsPixels.data());
+
+   MosPrintf(MIL_TEXT("MbufCopyColor2d: %.2f us/tile\n"), MilTime * 1e6 / NB_TILES);
+   MosPrintf(MIL_TEXT("Raster rows:     %.2f us/tile (%.2fx)%s\n\n"), RowsTime * 1e6 / NB_TILES,
+             MilTime / std::max(RowsTime, 1e-9), MilPixels == RowsPixels ? MIL_TEXT("") : MIL_TEXT(", TILES DIFFER"));
+   }
@@ -0,0 +1,505 @@
+﻿//*************************************************************************************
+//
+// File name: DataPrepConfig.cpp
+//
+// Synopsis:  Run-time parameters of the data preparation: their defaults, and their
+//            parsing from a configuration file and command-line options.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "DataPrepConfig.h"
+#include <string>
+#include <stdexcept>
+#include <regex>
+
+MIL_STRING TrimString(const MIL_STRING& Str)
+   {
+   const MIL_STRING Blanks = MIL_TEXT(" \t\r\n");
+   std::size_t First = Str.find_first_not_of(Blanks);
+   if(First == MIL_STRING::npos)
+      return MIL_STRING();
+   std::size_t Last = Str.find_last_not_of(Blanks);
+   return Str.substr(First, Last - First + 1);
+   }
+
+MIL_STRING ToLowerString(MIL_STRING Str)
+   {
+   for(auto& Char : Str)
+      {
+      if(Char >= MIL_TEXT('A') && Char <= MIL_TEXT('Z'))
+         Char = Char - MIL_TEXT('A') + MIL_TEXT('a');
+      }
+   return Str;
+   }
+
+namespace
+   {
+   std::vector<MIL_STRING> SplitList(const MIL_STRING& Str)
+      {
+      std::vector<MIL_STRING> Items;
+      std::size_t Start = 0;
+      while(Start <= Str.size())
+         {
+         std::size_t End = Str.find(MIL_TEXT(','), Start);
+         if(End == MIL_STRING::npos)
+            End = Str.size();
+         MIL_STRING Item = TrimString(Str.substr(Start, End - Start));
+         if(!Item.empty())
+            Items.push_back(Item);
+         Start = End + 1;
+         }
+      return Items;
+      }
+
+   bool ParseBool(const MIL_STRING& Value)
+      {
+      MIL_STRING Lower = ToLowerString(Value);
+      if(Lower == MIL_TEXT("1") || Lower == MIL_TEXT("true") || Lower == MIL_TEXT("yes") || Lower == MIL_TEXT("on"))
+         return true;
+      if(Lower == MIL_TEXT("0") || Lower == MIL_TEXT("false") || Lower == MIL_TEXT("no") || Lower == MIL_TEXT("off"))
+         return false;
+      throw std::invalid_argument("ParseBool");
+      }
+
+   // Unlike std::stoll and std::stod alone, the whole value must be a number:
+   // 115px or 8O are rejected rather than read as 115 and 8.
+   MIL_INT ParseInt(const MIL_STRING& Value)
+      {
+      std::size_t End;
+      long long Int = std::stoll(Value, &End);
+      if(End != Value.size())
+         throw std::invalid_argument("ParseInt");
+      return (MIL_INT)Int;
+      }
+
+   MIL_DOUBLE ParseDouble(const MIL_STRING& Value)
+      {
+      std::size_t End;
+      MIL_DOUBLE Double = std::stod(Value, &End);
+      if(End != Value.size())
+         throw std::invalid_argument("ParseDouble");
+      return Double;
+      }
+
+   std::vector<MIL_INT> ParseIntList(const MIL_STRING& Value)
+      {
+      std::vector<MIL_INT> Ints;
+      for(const auto& Item : SplitList(Value))
+         Ints.push_back(ParseInt(Item));
+      return Ints;
+      }
+   }
+
+// Loads the configuration file, if any, then applies the command-line overrides.
+bool LoadConfig(int argc, MIL_TEXT_CHAR* argv[], SDataPrepConfig& Config)
+   {
+   // The configuration file is applied first so that the command line always wins.
+   const MIL_STRING CONFIG_OPTION = MIL_TEXT("--config=");
+   for(int ArgIndex = 1; ArgIndex < argc; ArgIndex++)
+      {
+      MIL_STRING Arg = argv[ArgIndex];
+      if(ToLowerString(Arg.substr(0, CONFIG_OPTION.size())) == CONFIG_OPTION)
+         {
+         if(!ReadConfigFile(Arg.substr(CONFIG_OPTION.size()), Config))
+            return false;
+         }
+      }
+
+   for(int ArgIndex = 1; ArgIndex < argc; ArgIndex++)
+      {
+      MIL_STRING Arg = argv[ArgIndex];
+      if(Arg == MIL_TEXT("--help") || Arg == MIL_TEXT("-h") || Arg == MIL_TEXT("/?"))
+         return false;
+
+      std::size_t EqualPos = Arg.find(MIL_TEXT('='));
+      if(Arg.compare(0, 2, MIL_TEXT("--")) != 0 || EqualPos == MIL_STRING::npos)
+         {
+         MosPrintf(MIL_TEXT("Invalid argument: %s\n\n"), Arg.c_str());
+         return false;
+         }
+
+      MIL_STRING Key = Arg.substr(2, EqualPos - 2);
+      if(ToLowerString(Key) == MIL_TEXT("config"))
+         continue;
+      if(!SetConfigValue(Key, Arg.substr(EqualPos + 1), Config))
+         return false;
+      }
+
+   return ValidateConfig(Config);
+   }
+
+// Reads a configuration file made of "Key = Value" lines. Empty lines and
+// lines starting with '#' or ';' are ignored. Lists are comma separated.
+bool ReadConfigFile(const MIL_STRING& ConfigFile, SDataPrepConfig& Config)
+   {
+   FILE* File = MosFopen(ConfigFile.c_str(), MIL_TEXT("rb"));
+   if(File == M_NULL)
+      {
+      MosPrintf(MIL_TEXT("Unable to open the configuration file %s.\n\n"), ConfigFile.c_str());
+      return false;
+      }
+
+   // The file is expected to be ASCII (or UTF-8 restricted to ASCII in the values).
+   std::string Content;
+   char Buffer[4096];
+   std::size_t NbRead;
+   while((NbRead = MosFread(Buffer, 1, sizeof(Buffer), File)) > 0)
+      Content.append(Buffer, NbRead);
+   MosFclose(File);
+
+   MIL_STRING Text(Content.begin(), Content.end());
+   std::size_t LineStart = 0;
+   MIL_INT LineNumber = 0;
+   while(LineStart < Text.size())
+      {
+      std::size_t LineEnd = Text.find(MIL_TEXT('\n'), LineStart);
+      if(LineEnd == MIL_STRING::npos)
+         LineEnd = Text.size();
+      MIL_STRING Line = TrimString(Text.substr(LineStart, LineEnd - LineStart));
+      LineStart = LineEnd + 1;
+      LineNumber++;
+
+      if(Line.empty() || Line[0] == MIL_TEXT('#') || Line[0] == MIL_TEXT(';'))
+         continue;
+
+      std::size_t EqualPos = Line.find(MIL_TEXT('='));
+      if(EqualPos == MIL_STRING::npos)
+         {
+         MosPrintf(MIL_TEXT("%s(%d): expected Key = Value.\n\n"), ConfigFile.c_str(), (int)LineNumber);
+         return false;
+         }
+
+      if(!SetConfigValue(TrimString(Line.substr(0, EqualPos)), TrimString(Line.substr(EqualPos + 1)), Config))
+         return false;
+      }
+
+   return true;
+   }
+
+// Sets one parameter from its textual value. Keys are case insensitive.
+bool SetConfigValue(const MIL_STRING& Key, const MIL_STRING& Value, SDataPrepConfig& Config)
+   {
+   MIL_STRING LowerKey = ToLowerString(Key);
+   try
+      {
+      if(LowerKey == MIL_TEXT("imagepath"))
+         Config.ImagePath = Value;
+      else if(LowerKey == MIL_TEXT("labelpath"))
+         Config.LabelPath = Value;
+      else if(LowerKey == MIL_TEXT("destdatapath"))
+         Config.DestDataPath = Value;
+      else if(LowerKey == MIL_TEXT("traindatasetfile"))
+         Config.TrainDatasetFile = Value;
+      else if(LowerKey == MIL_TEXT("devdatasetfile"))
+         Config.DevDatasetFile = Value;
+      else if(LowerKey == MIL_TEXT("sourcerecursive"))
+         Config.SourceRecursive = ParseBool(Value);
+      else if(LowerKey == MIL_TEXT("sourcemanifest"))
+         Config.SourceManifest = Value;
+      else if(LowerKey == MIL_TEXT("sourcearchive"))
+         Config.SourceArchive = Value;
+      else if(LowerKey == MIL_TEXT("archiveimagefolder"))
+         Config.ArchiveImageFolder = Value;
+      else if(LowerKey == MIL_TEXT("archivelabelfolder"))
+         Config.ArchiveLabelFolder = Value;
+      else if(LowerKey == MIL_TEXT("labelcachedir"))
+         Config.LabelCacheDir = Value;
+      else if(LowerKey == MIL_TEXT("noaugimagesize"))
+         Config.NoAugImageSize = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("tileimagesize"))
+         Config.TileImageSize = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("labelretinasize"))
+         Config.LabelRetinaSize = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("nbrandtilesperimage"))
+         Config.NbRandTilesPerImage = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("retinaminfraction"))
+         Config.RetinaMinFraction = ParseDouble(Value);
+      else if(LowerKey == MIL_TEXT("randomtilespacing"))
+         Config.RandomTileSpacing = ParseDouble(Value);
+      else if(LowerKey == MIL_TEXT("maxspacingattempts"))
+         Config.MaxSpacingAttempts = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("nearduplicatedistance"))
+         Config.NearDuplicateDistance = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("bandheight"))
+         Config.BandHeight = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("tilecopy"))
+         Config.TileCopy = ToLowerString(Value);
+      else if(LowerKey == MIL_TEXT("benchmarktilecopy"))
+         Config.BenchmarkTileCopy = ParseBool(Value);
+      else if(LowerKey == MIL_TEXT("percentageintraindataset"))
+         Config.PercentageInTrainDataset = ParseDouble(Value);
+      else if(LowerKey == MIL_TEXT("splitmode"))
+         Config.SplitMode = ToLowerString(Value);
+      else if(LowerKey == MIL_TEXT("splitseed"))
+         Config.SplitSeed = (unsigned int)ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("splitgrouppattern"))
+         Config.SplitGroupPattern = Value;
+      else if(LowerKey == MIL_TEXT("classnames"))
+         Config.ClassNames = SplitList(Value);
+      else if(LowerKey == MIL_TEXT("classicons"))
+         Config.ClassIcons = SplitList(Value);
+      else if(LowerKey == MIL_TEXT("classlabelvalues"))
+         Config.ClassLabelValues = ParseIntList(Value);
+      else if(LowerKey == MIL_TEXT("nbaugmentationperimage"))
+         Config.NbAugmentationPerImage = ParseIntList(Value);
+      else if(LowerKey == MIL_TEXT("directcrop"))
+         Config.DirectCrop = ParseBool(Value);
+      else if(LowerKey == MIL_TEXT("outputfanout"))
+         Config.OutputFanOut = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("outputencoding"))
+         Config.OutputEncoding = ToLowerString(Value);
+      else if(LowerKey == MIL_TEXT("outputthreads"))
+         Config.OutputThreads = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("randomseed"))
+         Config.RandomSeed = (unsigned int)ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("shard"))
+         {
+         // Expected format: <Index>/<Count>.
+         std::size_t SlashPos = Value.find(MIL_TEXT('/'));
+         if(SlashPos == MIL_STRING::npos)
+            throw std::invalid_argument("Shard");
+         Config.ShardIndex = ParseInt(Value.substr(0, SlashPos));
+         Config.ShardCount = ParseInt(Value.substr(SlashPos + 1));
+         }
+      else if(LowerKey == MIL_TEXT("mergeshards"))
+         Config.MergeShardCount = ParseInt(Value);
+      else if(LowerKey == MIL_TEXT("resetmode"))
+         Config.ResetMode = ToLowerString(Value);
+      else if(LowerKey == MIL_TEXT("collectgarbage"))
+         Config.CollectGarbage = ParseBool(Value);
+      else if(LowerKey == MIL_TEXT("interactive"))
+         Config.Interactive = ParseBool(Value);
+      else
+         {
+         MosPrintf(MIL_TEXT("Unknown parameter: %s\n\n"), Key.c_str());
+         return false;
+         }
+      }
+   catch(const std::exception&)
+      {
+      MosPrintf(MIL_TEXT("Invalid value for %s: %s\n\n"), Key.c_str(), Value.c_str());
+      return false;
+      }
+
+   return true;
+   }
+
+// Checks the consistency of the parameters before any processing is done.
+bool ValidateConfig(const SDataPrepConfig& Config)
+   {
+   MIL_INT NbClasses = Config.NumberOfClasses();
+   if(NbClasses < 2)
+      {
+      MosPrintf(MIL_TEXT("At least two classes are required (the first one is the background).\n\n"));
+      return false;
+      }
+   if((MIL_INT)Config.ClassLabelValues.size() != NbClasses ||
+      (MIL_INT)Config.NbAugmentationPerImage.size() != NbClasses ||
+      (!Config.ClassIcons.empty() && (MIL_INT)Config.ClassIcons.size() != NbClasses))
+      {
+      MosPrintf(MIL_TEXT("ClassLabelValues, NbAugmentationPerImage and ClassIcons (if not empty) must have one value per class.\n\n"));
+      return false;
+      }
+   for(MIL_INT i = 0; i < NbClasses; i++)
+      {
+      if(Config.ClassLabelValues[i] < 0 || Config.ClassLabelValues[i] > 255)
+         {
+         MosPrintf(MIL_TEXT("ClassLabelValues must be between 0 and 255, the values of the 8-bit label images.\n\n"));
+         return false;
+         }
+      if(Config.NbAugmentationPerImage[i] < 0)
+         {
+         MosPrintf(MIL_TEXT("NbAugmentationPerImage must not be negative.\n\n"));
+         return false;
+         }
+      }
+   if(Config.NbRandTilesPerImage < 0)
+      {
+      MosPrintf(MIL_TEXT("NbRandTilesPerImage must not be negative.\n\n"));
+      return false;
+      }
+   if(Config.TileImageSize <= 0 || Config.NoAugImageSize < Config.TileImageSize)
+      {
+      MosPrintf(MIL_TEXT("NoAugImageSize must be greater than or equal to TileImageSize.\n\n"));
+      return false;
+      }
+   if(Config.LabelRetinaSize <= 0 || Config.LabelRetinaSize > Config.NoAugImageSize)
+      {
+      MosPrintf(MIL_TEXT("LabelRetinaSize must be between 1 and NoAugImageSize.\n\n"));
+      return false;
+      }
+   if(Config.PercentageInTrainDataset < 0.0 || Config.PercentageInTrainDataset > 100.0)
+      {
+      MosPrintf(MIL_TEXT("PercentageInTrainDataset must be between 0 and 100.\n\n"));
+      return false;
+      }
+   if(Config.SplitMode != MIL_TEXT("mil") && Config.SplitMode != MIL_TEXT("hash") && Config.SplitMode != MIL_TEXT("group"))
+      {
+      MosPrintf(MIL_TEXT("SplitMode must be mil, hash or group.\n\n"));
+      return false;
+      }
+   if(!Config.SplitGroupPattern.empty())
+      {
+      if(Config.SplitMode != MIL_TEXT("group"))
+         {
+         MosPrintf(MIL_TEXT("SplitGroupPattern requires SplitMode=group.\n\n"));
+         return false;
+         }
+      try
+         {
+         std::basic_regex<MIL_TEXT_CHAR> GroupRegex(Config.SplitGroupPattern);
+         }
+      catch(const std::regex_error&)
+         {
+         MosPrintf(MIL_TEXT("SplitGroupPattern is not a valid regular expression.\n\n"));
+         return false;
+         }
+      }
+   if(Config.ShardCount < 1 || Config.ShardIndex < 0 || Config.ShardIndex >= Config.ShardCount)
+      {
+      MosPrintf(MIL_TEXT("Shard must be <Index>/<Count> with 0 <= Index < Count.\n\n"));
+      return false;
+      }
+   if(!Config.SourceManifest.empty() && !Config.SourceArchive.empty())
+      {
+      MosPrintf(MIL_TEXT("SourceManifest and SourceArchive cannot be combined.\n\n"));
+      return false;
+      }
+   if(Config.RetinaMinFraction < 0.0 || Config.RetinaMinFraction > 1.0)
+      {
+      MosPrintf(MIL_TEXT("RetinaMinFraction must be between 0 and 1.\n\n"));
+      return false;
+      }
+   if(Config.RandomTileSpacing < 0.0 || Config.RandomTileSpacing > 4.0)
+      {
+      MosPrintf(MIL_TEXT("RandomTileSpacing must be between 0 and 4.\n\n"));
+      return false;
+      }
+   if(Config.MaxSpacingAttempts < 1 || Config.MaxSpacingAttempts > 1000)
+      {
+      MosPrintf(MIL_TEXT("MaxSpacingAttempts must be between 1 and 1000.\n\n"));
+      return false;
+      }
+   if(Config.NearDuplicateDistance < -1 || Config.NearDuplicateDistance > 15)
+      {
+      MosPrintf(MIL_TEXT("NearDuplicateDistance must be between -1 and 15.\n\n"));
+      return false;
+      }
+   if(Config.BandHeight < 0)
+      {
+      MosPrintf(MIL_TEXT("BandHeight cannot be negative.\n\n"));
+      return false;
+      }
+   if(Config.TileCopy != MIL_TEXT("mil") && Config.TileCopy != MIL_TEXT("rows"))
+      {
+      MosPrintf(MIL_TEXT("TileCopy must be mil or rows.\n\n"));
+      return false;
+      }
+   if(Config.OutputFanOut < 0 || Config.OutputFanOut > 65536)
+      {
+      MosPrintf(MIL_TEXT("OutputFanOut must be between 0 and 65536.\n\n"));
+      return false;
+      }
+   if(Config.OutputEncoding != MIL_TEXT("native") && Config.OutputEncoding != MIL_TEXT("png") && Config.OutputEncoding != MIL_TEXT("bmp"))
+      {
+      MosPrintf(MIL_TEXT("OutputEncoding must be native, png or bmp.\n\n"));
+      return false;
+      }
+   if(Config.OutputThreads < 0 || Config.OutputThreads > 64)
+      {
+      MosPrintf(MIL_TEXT("OutputThreads must be between 0 and 64.\n\n"));
+      return false;
+      }
+   if(Config.ResetMode != MIL_TEXT("delete") && Config.ResetMode != MIL_TEXT("swap") && Config.ResetMode != MIL_TEXT("deferred"))
+      {
+      MosPrintf(MIL_TEXT("ResetMode must be delete, swap or deferred.\n\n"));
+      return false;
+      }
+   if(Config.MergeShardCount < 0 || (Config.MergeShardCount > 0 && Config.ShardCount > 1))
+      {
+      MosPrintf(MIL_TEXT("MergeShards cannot be combined with Shard.\n\n"));
+      return false;
+      }
+   return true;
+   }
+
+void PrintConfig(const SDataPrepConfig& Config)
+   {
+   MosPrintf(MIL_TEXT("[PARAMETERS]\n"));
+   MosPrintf(MIL_TEXT("ImagePath                = %s\n"), Config.ImagePath.c_str());
+   MosPrintf(MIL_TEXT("LabelPath                = %s\n"), Config.LabelPath.c_str());
+   MosPrintf(MIL_TEXT("DestDataPath             = %s\n"), Config.DestDataPath.c_str());
+   if(Config.SourceRecursive)
+      MosPrintf(MIL_TEXT("SourceRecursive          = 1\n"));
+   if(!Config.SourceManifest.empty())
+      MosPrintf(MIL_TEXT("SourceManifest           = %s\n"), Config.SourceManifest.c_str());
+   if(!Config.SourceArchive.empty())
+      {
+      MosPrintf(MIL_TEXT("SourceArchive            = %s\n"), Config.SourceArchive.c_str());
+      MosPrintf(MIL_TEXT("ArchiveImageFolder       = %s\n"), Config.ArchiveImageFolder.c_str());
+      MosPrintf(MIL_TEXT("ArchiveLabelFolder       = %s\n"), Config.ArchiveLabelFolder.c_str());
+      }
+   if(!Config.LabelCacheDir.empty())
+      MosPrintf(MIL_TEXT("LabelCacheDir            = %s\n"), Config.LabelCacheDir.c_str());
+   MosPrintf(MIL_TEXT("NoAugImageSize           = %d\n"), (int)Config.NoAugImageSize);
+   MosPrintf(MIL_TEXT("TileImageSize            = %d\n"), (int)Config.TileImageSize);
+   MosPrintf(MIL_TEXT("LabelRetinaSize          = %d\n"), (int)Config.LabelRetinaSize);
+   MosPrintf(MIL_TEXT("NbRandTilesPerImage      = %d\n"), (int)Config.NbRandTilesPerImage);
+   if(Config.RetinaMinFraction > 0.0)
+      MosPrintf(MIL_TEXT("RetinaMinFraction        = %.2f\n"), Config.RetinaMinFraction);
+   if(Config.RandomTileSpacing > 0.0)
+      {
+      MosPrintf(MIL_TEXT("RandomTileSpacing        = %.2f\n"), Config.RandomTileSpacing);
+      MosPrintf(MIL_TEXT("MaxSpacingAttempts       = %d\n"), (int)Config.MaxSpacingAttempts);
+      }
+   if(Config.NearDuplicateDistance >= 0)
+      MosPrintf(MIL_TEXT("NearDuplicateDistance    = %d\n"), (int)Config.NearDuplicateDistance);
+   if(Config.BandHeight > 0)
+      MosPrintf(MIL_TEXT("BandHeight               = %d\n"), (int)Config.BandHeight);
+   MosPrintf(MIL_TEXT("TileCopy                 = %s\n"), Config.TileCopy.c_str());
+   MosPrintf(MIL_TEXT("PercentageInTrainDataset = %.1f\n"), Config.PercentageInTrainDataset);
+   MosPrintf(MIL_TEXT("SplitMode                = %s\n"), Config.SplitMode.c_str());
+   if(Config.SplitMode != MIL_TEXT("mil"))
+      MosPrintf(MIL_TEXT("SplitSeed                = %u\n"), Config.SplitSeed);
+   if(!Config.SplitGroupPattern.empty())
+      MosPrintf(MIL_TEXT("SplitGroupPattern        = %s\n"), Config.SplitGroupPattern.c_str());
+   MosPrintf(MIL_TEXT("DirectCrop               = %d\n"), (int)Config.DirectCrop);
+   MosPrintf(MIL_TEXT("OutputFanOut             = %d\n"), (int)Config.OutputFanOut);
+   MosPrintf(MIL_TEXT("OutputEncoding           = %s\n"), Config.OutputEncoding.c_str());
+   MosPrintf(MIL_TEXT("OutputThreads            = %d\n"), (int)Config.OutputThreads);
+   MosPrintf(MIL_TEXT("RandomSeed               = %u\n"), Config.RandomSeed);
+   MosPrintf(MIL_TEXT("ResetMode                = %s\n"), Config.ResetMode.c_str());
+   if(Config.ShardCount > 1)
+      MosPrintf(MIL_TEXT("Shard                    = %d/%d\n"), (int)Config.ShardIndex, (int)Config.ShardCount);
+   if(Config.MergeShardCount > 0)
+      MosPrintf(MIL_TEXT("MergeShards              = %d\n"), (int)Config.MergeShardCount);
+   for(MIL_INT i = 0; i < Config.NumberOfClasses(); i++)
+      {
+      MosPrintf(MIL_TEXT("Class %d                  = %s (label value %d, %d augmentation(s))\n"), (int)i,
+                Config.ClassNames[i].c_str(), (int)Config.ClassLabelValues[i], (int)Config.NbAugmentationPerImage[i]);
+      }
+   MosPrintf(MIL_TEXT("\n"));
+   }
+
+void PrintUsage()
+   {
+   MosPrintf(MIL_TEXT("Usage: ClassWoodDataPreparation [--Config=<File>] [--<Key>=<Value> ...]\n\n")
+             MIL_TEXT("The configuration file holds one \"Key = Value\" per line. The command-line\n")
+             MIL_TEXT("options override the values of the configuration file. Available keys:\n")
+             MIL_TEXT("   ImagePath, LabelPath, DestDataPath, TrainDatasetFile, DevDatasetFile,\n")
+             MIL_TEXT("   SourceRecursive, SourceManifest, SourceArchive, ArchiveImageFolder,\n")
+             MIL_TEXT("   ArchiveLabelFolder, LabelCacheDir,\n")
+             MIL_TEXT("   NoAugImageSize, TileImageSize, LabelRetinaSize, RetinaMinFraction, NbRandTilesPerImage,\n")
+             MIL_TEXT("   RandomTileSpacing, MaxSpacingAttempts, NearDuplicateDistance, BandHeight, TileCopy,\n")
+             MIL_TEXT("   BenchmarkTileCopy,\n")
+             MIL_TEXT("   PercentageInTrainDataset, SplitMode, SplitSeed, SplitGroupPattern,\n")
+             MIL_TEXT("   ClassNames, ClassIcons, ClassLabelValues,\n")
+             MIL_TEXT("   NbAugmentationPerImage, DirectCrop, OutputFanOut, OutputEncoding, OutputThreads,\n")
+             MIL_TEXT("   RandomSeed, Shard, MergeShards, ResetMode, CollectGarbage, Interactive.\n")
+             MIL_TEXT("Lists (class parameters) are comma separated, with one value per class.\n\n")
+             MIL_TEXT("Distributed execution: run one process per shard with --Shard=<Index>/<Count>,\n")
+             MIL_TEXT("then a single process with --MergeShards=<Count> to build the final datasets.\n\n")
+             MIL_TEXT("Output reset: --ResetMode=swap renames the previous output aside and deletes it\n")
+             MIL_TEXT("in the background; --ResetMode=deferred leaves it for --CollectGarbage=1.\n\n"));
+   }
@@ -0,0 +1,228 @@
+﻿//*************************************************************************************
+//
+// File name: DataPrepConfig.h
+//
+// Synopsis:  Run-time parameters of the data preparation: their defaults, and their
+//            parsing from a configuration file and command-line options.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include <mil.h>
+#include <iterator>
+#include <vector>
+
+// Path definitions.
+#define IMAGE_ROOT_PATH M_IMAGE_PATH MIL_TEXT("/Classification/ClassWoodDataPreparation/")
+#define EXAMPLE_IMAGE_PATH           IMAGE_ROOT_PATH MIL_TEXT("Data/Images/")
+#define EXAMPLE_LABEL_PATH           IMAGE_ROOT_PATH MIL_TEXT("Data/Labels/")
+#define EXAMPLE_DEST_DATA_PATH       MIL_TEXT("Dest\\")
+
+// Default values of the run-time parameters. They can all be overridden using a
+// configuration file and/or command-line options (see SDataPrepConfig).
+
+// First crop larger tiles to have data during augmentaiton for overscan. 
+static const MIL_INT NO_AUG_IMAGE_SIZE = 140;
+
+// Size of the tiles that will be used for training. 
+static const MIL_INT TILE_IMAGE_SIZE = 115;
+
+// Define the retina size.
+// Label each tile using a smaller retina inside the tile.
+// The larger the size of retina, the coarser the result of segmentation.
+// The size come as percentage of Width and Height of the tile.
+static const MIL_INT LABEL_RETINA_SIZE = 16;
+
+// How many tiles to extract randomly from each image.
+static const MIL_INT NB_RAND_TILES_PER_IMAGE = 15;
+
+// With a minimum spacing between the random tiles, how many positions are
+// drawn by default for a tile before it is skipped.
+static const MIL_INT MAX_SPACING_ATTEMPTS = 30;
+
+// Percentage of the fullframe images that goes to the train dataset.
+static const MIL_DOUBLE PERCENTAGE_IN_TRAIN_DATASET = 80.0;
+
+// Define the classes.
+static const MIL_INT NUMBER_OF_CLASSES = 3;
+
+static const MIL_STRING CLASS_NAMES[NUMBER_OF_CLASSES] = {MIL_TEXT("NoDefect"),
+                                                          MIL_TEXT("LargeKnots"),
+                                                          MIL_TEXT("SmallKnots")};
+
+// Icon image for each class.
+static const MIL_STRING CLASS_ICONS[NUMBER_OF_CLASSES] = {IMAGE_ROOT_PATH MIL_TEXT("Data\\NoDefect.mim"),
+                                                          IMAGE_ROOT_PATH MIL_TEXT("Data\\LargeKnots.mim"),
+                                                          IMAGE_ROOT_PATH MIL_TEXT("Data\\SmallKnots.mim")};
+
+// Define the associated value of each class in the label image.
+static const MIL_INT CLASS_LABEL_VALUES[NUMBER_OF_CLASSES] = {0,1,2};
+
+// How many times to perform augmentation on the tiles of each class.
+// Augmentation can help to balance the dataset. 
+static const MIL_INT NB_AUGMENTATION_PER_IMAGE[NUMBER_OF_CLASSES] = {1, 9, 9};
+
+// All the parameters that drive the data preparation stages. The defaults
+// reproduce the original example. They are overridden, in order, by the
+// configuration file given with --Config=<File> and by the --<Key>=<Value>
+// command-line options, so that parameter sweeps do not require a rebuild.
+struct SDataPrepConfig
+   {
+   // Source and destination paths.
+   MIL_STRING ImagePath        = EXAMPLE_IMAGE_PATH;
+   MIL_STRING LabelPath        = EXAMPLE_LABEL_PATH;
+   MIL_STRING DestDataPath     = EXAMPLE_DEST_DATA_PATH;
+   MIL_STRING TrainDatasetFile = MIL_TEXT("TrainDataset.mclassd");
+   MIL_STRING DevDatasetFile   = MIL_TEXT("DevDataset.mclassd");
+
+   // Also take the images of the subfolders of ImagePath. Their labels are in
+   // the same subfolders of LabelPath.
+   bool SourceRecursive = false;
+
+   // CSV or JSONL file listing the image/label pairs, one per line, used
+   // instead of the ImagePath and LabelPath folders. Relative paths are
+   // relative to the folder of the manifest.
+   MIL_STRING SourceManifest;
+
+   // Zip archive of the source images and labels (e.g. Data.zip). When set,
+   // the images and the labels are read from the two folders of the archive,
+   // in memory, instead of from ImagePath and LabelPath.
+   MIL_STRING SourceArchive;
+   MIL_STRING ArchiveImageFolder = MIL_TEXT("Data/Images/");
+   MIL_STRING ArchiveLabelFolder = MIL_TEXT("Data/Labels/");
+
+   // Folder of the label cache, shared by the runs (empty disables it). It
+   // keeps the index of each label image, with its blobs, so that the next
+   // runs do not decode the labels nor run the blob analysis again.
+   MIL_STRING LabelCacheDir;
+
+   // Tile extraction.
+   MIL_INT NoAugImageSize      = NO_AUG_IMAGE_SIZE;
+   MIL_INT TileImageSize       = TILE_IMAGE_SIZE;
+   MIL_INT LabelRetinaSize     = LABEL_RETINA_SIZE;
+   MIL_INT NbRandTilesPerImage = NB_RAND_TILES_PER_IMAGE;
+
+   // Rule deciding the class of the random tiles from their retina box. With
+   // 0, the highest label value in the retina wins. Otherwise, the class with
+   // the highest label value among those that cover at least this fraction
+   // of the retina wins, and the tile is background if none does.
+   MIL_DOUBLE RetinaMinFraction = 0.0;
+
+   // Near-duplicate tiles (-1 keeps them all). A tile is dropped, before it is
+   // saved and augmented, when the 64-bit average hash of the tile differs by
+   // at most this many bits (0 to 15) from the one of a tile already kept of
+   // the same source image and class that it overlaps.
+   MIL_INT NearDuplicateDistance = -1;
+
+   // Minimum distance between the random tiles of an image, as a fraction of
+   // the tile size (0 draws them independently). A position too close to a
+   // tile already drawn is drawn again (Poisson-disk sampling), so the same
+   // number of tiles covers more of the image; a tile that cannot be placed
+   // after MaxSpacingAttempts draws is skipped.
+   MIL_DOUBLE RandomTileSpacing = 0.0;
+   MIL_INT    MaxSpacingAttempts = MAX_SPACING_ATTEMPTS;
+
+   // Height of the bands in which the source images and labels are read (0
+   // reads them whole). Each band is read with one tile height of overlap,
+   // so that memory stays bounded whatever the size of the source images.
+   MIL_INT BandHeight = 0;
+
+   // How the tiles are copied from the source images:
+   //    mil:  MbufCopyColor2d from the image, or from its band, in a MIL buffer.
+   //    rows: the uncompressed TIFF and BMP files are mapped, the tiles are
+   //          split straight from their packed rows into planar tiles, and
+   //          the gray labels are indexed from their rows in place.
+   // BenchmarkTileCopy=1 only times both copies on the first source image.
+   MIL_STRING TileCopy = MIL_TEXT("mil");
+   bool BenchmarkTileCopy = false;
+
+   // Train/dev split:
+   //    mil:  MclassSplitDataset on a dataset of all the source images.
+   //    hash: each source image goes to train or dev from a hash of its name
+   //          and SplitSeed, without building that dataset. An image keeps
+   //          its side when images are added, and the shards take their own
+   //          images, also from a hash, without a global pass.
+   //    group: as hash, but the hash is taken on the group of the image, so
+   //          that all the frames of a board or a log end up on the same side.
+   //          The group is the "group" column of the manifest or, for the
+   //          images without one, the first capture of SplitGroupPattern (a
+   //          regular expression searched in the name, the whole match if it
+   //          has no capture); the images that have neither are their own group.
+   MIL_DOUBLE   PercentageInTrainDataset = PERCENTAGE_IN_TRAIN_DATASET;
+   MIL_STRING   SplitMode = MIL_TEXT("mil");
+   unsigned int SplitSeed = 42;
+   MIL_STRING   SplitGroupPattern;
+
+   // Classes. All the vectors must have one element per class, except
+   // ClassIcons that can be left empty.
+   std::vector<MIL_STRING> ClassNames{std::begin(CLASS_NAMES), std::end(CLASS_NAMES)};
+   std::vector<MIL_STRING> ClassIcons{std::begin(CLASS_ICONS), std::end(CLASS_ICONS)};
+   std::vector<MIL_INT>    ClassLabelValues{std::begin(CLASS_LABEL_VALUES), std::end(CLASS_LABEL_VALUES)};
+   std::vector<MIL_INT>    NbAugmentationPerImage{std::begin(NB_AUGMENTATION_PER_IMAGE), std::end(NB_AUGMENTATION_PER_IMAGE)};
+
+   // Extract the tiles that are not augmented directly at TileImageSize, and
+   // augment the train tiles as they are extracted, from the NoAugImageSize
+   // tile still in memory. The augmented tiles are always saved at their
+   // final size, so nothing is left for the crop stage.
+   bool DirectCrop = false;
+
+   // Number of subfolders over which the tiles of each class are spread, to
+   // keep the class folders small (0 keeps them flat). The subfolder of a
+   // tile is chosen from a hash of its source image name, e.g. Dest\LargeKnots\3f\.
+   MIL_INT OutputFanOut = 0;
+
+   // Encoding of the saved tiles:
+   //    native: MIL native format, under the extension of the source images.
+   //    png:    lossless PNG, about half the size of the native tiles.
+   //    bmp:    uncompressed BMP, written with a single write per tile.
+   // With OutputThreads > 0, the tiles are encoded and written by that many
+   // worker threads while the extraction goes on.
+   MIL_STRING OutputEncoding = MIL_TEXT("native");
+   MIL_INT    OutputThreads  = 0;
+
+   // Seed of the random tile positions and of the augmentations. Each image,
+   // and each augmented tile, uses its own generator, seeded from this value
+   // and its name, so that the tiles do not depend on the order or the
+   // process in which the images are handled.
+   unsigned int RandomSeed = 42;
+
+   // Distributed execution. A process with ShardCount > 1 only handles the
+   // source images of shard ShardIndex and saves partial datasets. A process
+   // with MergeShardCount > 0 only merges the partial datasets of that many
+   // shards into the final datasets.
+   MIL_INT ShardIndex      = 0;
+   MIL_INT ShardCount      = 1;
+   MIL_INT MergeShardCount = 0;
+
+   // How an existing output folder is reset before a run:
+   //    delete:   its tiles are deleted before the extraction starts.
+   //    swap:     it is renamed aside, a fresh folder is created, and the old
+   //              one is deleted in the background during the run.
+   //    deferred: it is renamed aside and left for a later run with
+   //              CollectGarbage=1, that only deletes the old folders.
+   MIL_STRING ResetMode = MIL_TEXT("delete");
+   bool CollectGarbage = false;
+
+   // Set to false to run without display and without waiting for the user.
+   bool Interactive = true;
+
+   MIL_INT NumberOfClasses() const { return (MIL_INT)ClassNames.size(); }
+   };
+
+bool LoadConfig(int argc, MIL_TEXT_CHAR* argv[], SDataPrepConfig& Config);
+
+bool ReadConfigFile(const MIL_STRING& ConfigFile, SDataPrepConfig& Config);
+
+bool SetConfigValue(const MIL_STRING& Key, const MIL_STRING& Value, SDataPrepConfig& Config);
+
+bool ValidateConfig(const SDataPrepConfig& Config);
+
+void PrintConfig(const SDataPrepConfig& Config);
+
+void PrintUsage();
+
+MIL_STRING TrimString(const MIL_STRING& Str);
+
+MIL_STRING ToLowerString(MIL_STRING Str);
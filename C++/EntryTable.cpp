@@ -0,0 +1,289 @@
+﻿//*************************************************************************************
+//
+// File name: EntryTable.cpp
+//
+// Synopsis:  Columnar tables of the dataset entries, handed over from one stage to
+//            the next, and the names of the tiles.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "EntryTable.h"
+#include "Utilities.h"
+#include <algorithm>
+
+MIL_UINT32 CStringArena::Add(const MIL_TEXT_CHAR* Str, std::size_t Length)
+   {
+   MIL_UINT32 Id = (MIL_UINT32)m_Offsets.size();
+   m_Offsets.push_back(m_Chars.size());
+   m_Lengths.push_back((MIL_UINT32)Length);
+   m_Hashes.push_back(HashChars(Str, Length, 0));
+   m_Chars.insert(m_Chars.end(), Str, Str + Length);
+   m_Chars.push_back(MIL_TEXT('\0'));
+
+   // Keep the hash table at most half full.
+   if(2 * m_Offsets.size() > m_HashSlots.size())
+      GrowHashTable();
+   else
+      {
+      std::size_t Mask = m_HashSlots.size() - 1;
+      std::size_t Slot = (std::size_t)m_Hashes[Id] & Mask;
+      while(m_HashSlots[Slot] != 0)
+         Slot = (Slot + 1) & Mask;
+      m_HashSlots[Slot] = Id + 1;
+      }
+   return Id;
+   }
+
+MIL_UINT32 CStringArena::Intern(const MIL_TEXT_CHAR* Str, std::size_t Length)
+   {
+   if(!m_HashSlots.empty())
+      {
+      MIL_UINT64 Hash = HashChars(Str, Length, 0);
+      std::size_t Mask = m_HashSlots.size() - 1;
+      for(std::size_t Slot = (std::size_t)Hash & Mask; m_HashSlots[Slot] != 0; Slot = (Slot + 1) & Mask)
+         {
+         MIL_UINT32 Id = m_HashSlots[Slot] - 1;
+         if(m_Hashes[Id] == Hash && m_Lengths[Id] == Length &&
+            std::char_traits<MIL_TEXT_CHAR>::compare(Get(Id), Str, Length) == 0)
+            return Id;
+         }
+      }
+   return Add(Str, Length);
+   }
+
+void CStringArena::Reserve(MIL_INT NbStrings, MIL_INT NbChars)
+   {
+   m_Offsets.reserve((std::size_t)NbStrings);
+   m_Lengths.reserve((std::size_t)NbStrings);
+   m_Hashes.reserve((std::size_t)NbStrings);
+   m_Chars.reserve((std::size_t)NbChars);
+   while(m_HashSlots.size() < 2 * (std::size_t)NbStrings)
+      GrowHashTable();
+   }
+
+void CStringArena::GrowHashTable()
+   {
+   std::size_t NbSlots = std::max<std::size_t>(64, 2 * m_HashSlots.size());
+   m_HashSlots.assign(NbSlots, 0);
+   for(MIL_UINT32 Id = 0; Id < (MIL_UINT32)m_Offsets.size(); Id++)
+      {
+      std::size_t Slot = (std::size_t)m_Hashes[Id] & (NbSlots - 1);
+      while(m_HashSlots[Slot] != 0)
+         Slot = (Slot + 1) & (NbSlots - 1);
+      m_HashSlots[Slot] = Id + 1;
+      }
+   }
+
+CTilePathBuilder::CTilePathBuilder(const MIL_STRING& DestPath, const std::vector<MIL_STRING>& ClassNames, MIL_INT FanOut,
+                                   const MIL_STRING& Extension)
+   : m_FanOut(FanOut),
+     m_OutputExtension(Extension)
+   {
+   for(const auto& ClassName : ClassNames)
+      m_ClassPrefixes.push_back(DestPath + ClassName + MIL_TEXT("\\"));
+   m_Path.reserve(MAX_PATH_RESERVE);
+   }
+
+MIL_STRING CTilePathBuilder::FanOutFolderName(MIL_INT Bucket, MIL_INT FanOut)
+   {
+   static const MIL_TEXT_CHAR HEX_DIGITS[] = MIL_TEXT("0123456789abcdef");
+
+   // As many digits as required by the last subfolder.
+   MIL_INT NbDigits = 1;
+   while((FanOut - 1) >> (4 * NbDigits))
+      NbDigits++;
+
+   MIL_STRING Name((std::size_t)NbDigits, MIL_TEXT('0'));
+   for(MIL_INT i = NbDigits - 1; i >= 0; i--, Bucket >>= 4)
+      Name[(std::size_t)i] = HEX_DIGITS[Bucket & 0xF];
+   return Name;
+   }
+
+// Splits the source path into its stem and its extension. With class folders,
+// the folders of the source are flattened into the stem.
+void CTilePathBuilder::SetSource(const MIL_TEXT_CHAR* SourcePath)
+   {
+   const bool KeepFileNameOnly = !m_ClassPrefixes[0].empty();
+   m_Stem.clear();
+   const MIL_TEXT_CHAR* Start = SourcePath;
+   const MIL_TEXT_CHAR* Dot = M_NULL;
+   const MIL_TEXT_CHAR* End = SourcePath;
+   for(; *End != MIL_TEXT('\0'); End++)
+      {
+      if(*End == MIL_TEXT('.'))
+         Dot = End;
+      else if(*End == MIL_TEXT('\\') || *End == MIL_TEXT('/'))
+         {
+         // A dot in a folder name is not an extension.
+         Dot = M_NULL;
+         if(KeepFileNameOnly)
+            {
+            // The subfolders of the source are kept in the stem, so that the
+            // images of different folders do not collide, e.g. Line2\Image01.bmp
+            // gives Line2_Image01. The drive and the . and .. folders are dropped.
+            std::size_t Length = (std::size_t)(End - Start);
+            bool IsRelative = (Length == 1 && Start[0] == MIL_TEXT('.')) ||
+                              (Length == 2 && Start[0] == MIL_TEXT('.') && Start[1] == MIL_TEXT('.'));
+            if(Length > 0 && !IsRelative && Start[Length - 1] != MIL_TEXT(':'))
+               {
+               m_Stem.append(Start, End);
+               m_Stem += MIL_TEXT('_');
+               }
+            Start = End + 1;
+            }
+         }
+      }
+   if(Dot == M_NULL)
+      Dot = End;
+
+   m_Stem.append(Start, Dot);
+   if(m_OutputExtension.empty())
+      m_Extension.assign(Dot, End);
+   else
+      m_Extension = m_OutputExtension;
+
+   // The subfolder only depends on the source name, so that it is the same in
+   // every process and all the tiles of an image are together.
+   if(m_FanOut > 0)
+      {
+      MIL_INT Bucket = (MIL_INT)(HashChars(SourcePath, (std::size_t)(End - SourcePath), 0) % (MIL_UINT64)m_FanOut);
+      m_FanOutFolder = FanOutFolderName(Bucket, m_FanOut);
+      m_FanOutFolder += MIL_TEXT('\\');
+      }
+   }
+
+const MIL_STRING& CTilePathBuilder::Build(MIL_INT ClassIndex, const MIL_TEXT_CHAR* Tag, MIL_INT Index0, MIL_INT Index1, MIL_INT MinDigits)
+   {
+   m_Path.assign(m_ClassPrefixes[(std::size_t)ClassIndex]);
+   m_Path.append(m_FanOutFolder);
+   m_Path.append(m_Stem);
+   m_Path.append(Tag);
+   AppendNumber(Index0, MinDigits);
+   if(Index1 >= 0)
+      {
+      m_Path.push_back(MIL_TEXT('_'));
+      AppendNumber(Index1, MinDigits);
+      }
+   m_Path.append(m_Extension);
+   return m_Path;
+   }
+
+void CTilePathBuilder::AppendNumber(MIL_INT Value, MIL_INT MinDigits)
+   {
+   MIL_TEXT_CHAR Digits[24];
+   MIL_INT NbDigits = 0;
+   do
+      {
+      Digits[NbDigits++] = (MIL_TEXT_CHAR)(MIL_TEXT('0') + Value % 10);
+      Value /= 10;
+      }
+   while(Value > 0 || NbDigits < MinDigits);
+
+   while(NbDigits > 0)
+      m_Path.push_back(Digits[--NbDigits]);
+   }
+
+MIL_INT CEntryTable::AddEntry(const MIL_TEXT_CHAR* FilePath,
+                              std::size_t FilePathLength,
+                              MIL_INT ClassIndex,
+                              MIL_INT SourceIndex,
+                              MIL_INT OffsetX,
+                              MIL_INT OffsetY,
+                              MIL_INT AugmentationSource,
+                              MIL_UINT32 AugmentationSeed,
+                              MIL_INT ImageSize)
+   {
+   m_PathIds.push_back(m_Paths.Intern(FilePath, FilePathLength));
+   m_ClassIndices.push_back((MIL_INT32)ClassIndex);
+   m_SourceIndices.push_back((MIL_INT32)SourceIndex);
+   m_OffsetsX.push_back((MIL_INT32)OffsetX);
+   m_OffsetsY.push_back((MIL_INT32)OffsetY);
+   m_AugmentationSources.push_back((MIL_INT32)AugmentationSource);
+   m_AugmentationSeeds.push_back(AugmentationSeed);
+   m_ImageSizes.push_back((MIL_INT32)ImageSize);
+   return NumberOfEntries() - 1;
+   }
+
+// Appends the entries of another table. The augmentation sources are re-based
+// so that they keep pointing to the same entries.
+void CEntryTable::Append(const CEntryTable& Other)
+   {
+   MIL_INT FirstIndex = NumberOfEntries();
+   Reserve(FirstIndex + Other.NumberOfEntries());
+   for(MIL_INT i = 0; i < Other.NumberOfEntries(); i++)
+      {
+      MIL_INT AugmentationSource = Other.AugmentationSource(i);
+      if(AugmentationSource != NO_AUGMENTATION_SOURCE)
+         AugmentationSource += FirstIndex;
+      AddEntry(Other.FilePath(i), Other.FilePathLength(i), Other.ClassIndex(i), Other.SourceIndex(i),
+               Other.OffsetX(i), Other.OffsetY(i), AugmentationSource, Other.AugmentationSeed(i), Other.ImageSize(i));
+      }
+   }
+
+void CEntryTable::Reserve(MIL_INT NbEntries, MIL_INT AveragePathLength)
+   {
+   std::size_t Size = (std::size_t)NbEntries;
+   m_Paths.Reserve(NbEntries, NbEntries * (AveragePathLength + 1));
+   m_PathIds.reserve(Size);
+   m_ClassIndices.reserve(Size);
+   m_SourceIndices.reserve(Size);
+   m_OffsetsX.reserve(Size);
+   m_OffsetsY.reserve(Size);
+   m_AugmentationSources.reserve(Size);
+   m_AugmentationSeeds.reserve(Size);
+   m_ImageSizes.reserve(Size);
+   }
+
+// Appends all the entries of a dataset to the table.
+void CEntryTable::LoadFromDataset(MIL_ID Dataset, const std::map<MIL_STRING, MIL_INT>* ListingIndices)
+   {
+   MIL_INT FirstIndex = NumberOfEntries();
+   MIL_INT NbEntries;
+   MclassInquire(Dataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &NbEntries);
+   Reserve(FirstIndex + NbEntries);
+
+   for(MIL_INT i = 0; i < NbEntries; i++)
+      {
+      MIL_STRING FilePath;
+      MIL_INT GroundTruthIndex, AugmentationSource = NO_AUGMENTATION_SOURCE;
+      MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, FilePath);
+      MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH + M_TYPE_MIL_INT, &GroundTruthIndex);
+      if(IsAugmentedFileName(FilePath))
+         MclassInquireEntry(Dataset, i, M_DEFAULT_KEY, M_DEFAULT, M_AUGMENTATION_SOURCE + M_TYPE_MIL_INT, &AugmentationSource);
+
+      if(AugmentationSource >= 0 && AugmentationSource < NbEntries)
+         AugmentationSource += FirstIndex;
+      else
+         AugmentationSource = NO_AUGMENTATION_SOURCE;
+
+      MIL_INT SourceIndex = i;
+      if(ListingIndices)
+         {
+         auto Listed = ListingIndices->find(FilePath);
+         if(Listed != ListingIndices->end())
+            SourceIndex = Listed->second;
+         }
+      AddEntry(FilePath, GroundTruthIndex, SourceIndex, 0, 0, AugmentationSource);
+      }
+   }
+
+// Appends all the entries of the table to the dataset. The per-entry MIL
+// calls are grouped here, in a tight loop, instead of being interleaved with
+// the image processing and file I/O of the stages.
+void CEntryTable::CommitToDataset(MIL_ID Dataset) const
+   {
+   MIL_INT FirstIndex;
+   MclassInquire(Dataset, M_DEFAULT, M_NUMBER_OF_ENTRIES + M_TYPE_MIL_INT, &FirstIndex);
+
+   for(MIL_INT i = 0; i < NumberOfEntries(); i++)
+      {
+      MIL_INT EntryIndex = FirstIndex + i;
+
+      MclassControl(Dataset, M_DEFAULT, M_ENTRY_ADD, M_DEFAULT);
+      MclassControlEntry(Dataset, EntryIndex, M_DEFAULT_KEY, M_REGION_INDEX(0), M_CLASS_INDEX_GROUND_TRUTH, ClassIndex(i), M_NULL, M_DEFAULT);
+      MclassControlEntry(Dataset, EntryIndex, M_DEFAULT_KEY, M_DEFAULT, M_FILE_PATH, M_DEFAULT, FilePath(i), M_DEFAULT);
+      if(AugmentationSource(i) != NO_AUGMENTATION_SOURCE)
+         MclassControlEntry(Dataset, EntryIndex, M_DEFAULT_KEY, M_DEFAULT, M_AUGMENTATION_SOURCE, FirstIndex + AugmentationSource(i), M_NULL, M_DEFAULT);
+      }
+   }
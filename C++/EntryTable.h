@@ -0,0 +1,157 @@
+﻿//*************************************************************************************
+//
+// File name: EntryTable.h
+//
+// Synopsis:  Columnar tables of the dataset entries, handed over from one stage to
+//            the next, and the names of the tiles.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include <mil.h>
+#include <vector>
+#include <map>
+
+// Arena holding null-terminated strings contiguously, referred to by id.
+// Intern() returns the id of an identical string already in the arena, if
+// any, using an open-addressing hash table, so a string is stored only once.
+// The pointer returned by Get() is valid until the next string is added.
+class CStringArena
+   {
+   public:
+      MIL_UINT32 Add(const MIL_TEXT_CHAR* Str, std::size_t Length);
+      MIL_UINT32 Intern(const MIL_TEXT_CHAR* Str, std::size_t Length);
+      MIL_UINT32 Intern(const MIL_STRING& Str) { return Intern(Str.c_str(), Str.size()); }
+
+      const MIL_TEXT_CHAR* Get(MIL_UINT32 Id) const { return &m_Chars[m_Offsets[Id]]; }
+      std::size_t Length(MIL_UINT32 Id) const       { return m_Lengths[Id]; }
+      MIL_INT NumberOfStrings() const               { return (MIL_INT)m_Offsets.size(); }
+
+      void Reserve(MIL_INT NbStrings, MIL_INT NbChars);
+
+   private:
+      void GrowHashTable();
+
+      std::vector<MIL_TEXT_CHAR> m_Chars;
+      std::vector<std::size_t>   m_Offsets;
+      std::vector<MIL_UINT32>    m_Lengths;
+      std::vector<MIL_UINT64>    m_Hashes;
+      std::vector<MIL_UINT32>    m_HashSlots; // Id + 1 of the string in each slot, 0 if free.
+   };
+
+// Builds the file names of the tiles without heap allocation in the steady
+// state. The class folders are computed once, the stem, the extension and the
+// fan-out subfolder of the source once per source, and each tile only appends
+// its suffix to a reused buffer, e.g. Dest\LargeKnots\ + 3f\ + Image01 +
+// _CoG_01_03 + .bmp.
+class CTilePathBuilder
+   {
+   public:
+      // Without class folders, the tiles are named after the source path itself.
+      CTilePathBuilder() : m_ClassPrefixes(1) { m_Path.reserve(MAX_PATH_RESERVE); }
+      // A non-empty Extension replaces the extension of the sources.
+      CTilePathBuilder(const MIL_STRING& DestPath, const std::vector<MIL_STRING>& ClassNames, MIL_INT FanOut = 0,
+                       const MIL_STRING& Extension = MIL_STRING());
+
+      // Name of a fan-out subfolder, in hexadecimal.
+      static MIL_STRING FanOutFolderName(MIL_INT Bucket, MIL_INT FanOut);
+
+      void SetSource(const MIL_TEXT_CHAR* SourcePath);
+
+      // Returns <ClassFolder><Stem><Tag><Index0>[_<Index1>]<Extension>, the
+      // indices being zero padded to MinDigits. The reference is valid until
+      // the next call.
+      const MIL_STRING& Build(MIL_INT ClassIndex, const MIL_TEXT_CHAR* Tag, MIL_INT Index0,
+                              MIL_INT Index1 = -1, MIL_INT MinDigits = 2);
+
+   private:
+      static const std::size_t MAX_PATH_RESERVE = 512;
+
+      void AppendNumber(MIL_INT Value, MIL_INT MinDigits);
+
+      std::vector<MIL_STRING> m_ClassPrefixes;
+      MIL_INT                 m_FanOut = 0;
+      MIL_STRING              m_FanOutFolder;
+      MIL_STRING              m_Stem;
+      MIL_STRING              m_OutputExtension;
+      MIL_STRING              m_Extension;
+      MIL_STRING              m_Path;
+   };
+
+// The stages hand their entries over to each other through columnar tables:
+// one array per field and the file paths in a string arena. A stage reads the
+// table of the previous stage and appends to its own, and the MIL dataset is
+// only built once, at the end, by CommitToDataset. The tables do not touch
+// any MIL object, so each producer can fill its own table and the tables can
+// be appended before being committed.
+class CEntryTable
+   {
+   public:
+      static const MIL_INT NO_AUGMENTATION_SOURCE = -1;
+      static const MIL_INT UNKNOWN_IMAGE_SIZE     = 0;
+
+      // Adds an entry and returns its index in the table. The augmentation
+      // source is the index, in this table, of the entry that was augmented.
+      MIL_INT AddEntry(const MIL_TEXT_CHAR* FilePath,
+                       std::size_t FilePathLength,
+                       MIL_INT ClassIndex,
+                       MIL_INT SourceIndex,
+                       MIL_INT OffsetX = 0,
+                       MIL_INT OffsetY = 0,
+                       MIL_INT AugmentationSource = NO_AUGMENTATION_SOURCE,
+                       MIL_UINT32 AugmentationSeed = 0,
+                       MIL_INT ImageSize = UNKNOWN_IMAGE_SIZE);
+      MIL_INT AddEntry(const MIL_STRING& FilePath,
+                       MIL_INT ClassIndex,
+                       MIL_INT SourceIndex,
+                       MIL_INT OffsetX = 0,
+                       MIL_INT OffsetY = 0,
+                       MIL_INT AugmentationSource = NO_AUGMENTATION_SOURCE,
+                       MIL_UINT32 AugmentationSeed = 0,
+                       MIL_INT ImageSize = UNKNOWN_IMAGE_SIZE)
+         {
+         return AddEntry(FilePath.c_str(), FilePath.size(), ClassIndex, SourceIndex, OffsetX, OffsetY,
+                         AugmentationSource, AugmentationSeed, ImageSize);
+         }
+
+      void Append(const CEntryTable& Other);
+      void Reserve(MIL_INT NbEntries, MIL_INT AveragePathLength = 64);
+
+      MIL_INT NumberOfEntries() const { return (MIL_INT)m_PathIds.size(); }
+
+      const MIL_TEXT_CHAR* FilePath(MIL_INT Index) const { return m_Paths.Get(m_PathIds[(std::size_t)Index]); }
+      std::size_t FilePathLength(MIL_INT Index) const    { return m_Paths.Length(m_PathIds[(std::size_t)Index]); }
+      MIL_INT ClassIndex(MIL_INT Index) const            { return m_ClassIndices[(std::size_t)Index]; }
+      MIL_INT SourceIndex(MIL_INT Index) const           { return m_SourceIndices[(std::size_t)Index]; }
+      MIL_INT OffsetX(MIL_INT Index) const               { return m_OffsetsX[(std::size_t)Index]; }
+      MIL_INT OffsetY(MIL_INT Index) const               { return m_OffsetsY[(std::size_t)Index]; }
+      MIL_INT AugmentationSource(MIL_INT Index) const    { return m_AugmentationSources[(std::size_t)Index]; }
+      MIL_UINT32 AugmentationSeed(MIL_INT Index) const   { return m_AugmentationSeeds[(std::size_t)Index]; }
+      MIL_INT ImageSize(MIL_INT Index) const             { return m_ImageSizes[(std::size_t)Index]; }
+
+      // When the indices of the listed images are given, the source index of
+      // a loaded entry is the index of its image in the listing instead of
+      // its position in the dataset.
+      void LoadFromDataset(MIL_ID Dataset, const std::map<MIL_STRING, MIL_INT>* ListingIndices = nullptr);
+      void CommitToDataset(MIL_ID Dataset) const;
+
+      // Only the augmented images are named with this suffix, so the other
+      // entries skip the inquiry of their augmentation source.
+      static bool IsAugmentedFileName(const MIL_STRING& FilePath)
+         {
+         return FilePath.find(MIL_TEXT("_Aug_")) != MIL_STRING::npos;
+         }
+
+   private:
+      CStringArena            m_Paths;
+      std::vector<MIL_UINT32> m_PathIds;
+      std::vector<MIL_INT32>  m_ClassIndices;
+      std::vector<MIL_INT32>  m_SourceIndices;       // Index of the source image in the listing.
+      std::vector<MIL_INT32>  m_OffsetsX;            // Position of the tile in the source image.
+      std::vector<MIL_INT32>  m_OffsetsY;
+      std::vector<MIL_INT32>  m_AugmentationSources;
+      std::vector<MIL_UINT32> m_AugmentationSeeds;   // Seed used to generate an augmented entry.
+      std::vector<MIL_INT32>  m_ImageSizes;          // Size of the saved (square) image, if known.
+   };
@@ -0,0 +1,376 @@
+﻿//*************************************************************************************
+//
+// File name: ImageSources.cpp
+//
+// Synopsis:  Sources of the image/label pairs: folders, manifests (CSV or JSONL) and
+//            zip archives.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "ImageSources.h"
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+// Creates the source selected by the parameters: a manifest, an archive or,
+// by default, the image and label folders.
+std::unique_ptr<CImageSource> CreateImageSource(const SDataPrepConfig& Config)
+   {
+   std::unique_ptr<CImageSource> Source;
+   if(!Config.SourceManifest.empty())
+      {
+      std::unique_ptr<CManifestImageSource> ManifestSource(new CManifestImageSource);
+      if(!ManifestSource->Open(Config.SourceManifest))
+         return nullptr;
+      Source = std::move(ManifestSource);
+      }
+   else if(!Config.SourceArchive.empty())
+      {
+      std::unique_ptr<CArchiveImageSource> ArchiveSource(new CArchiveImageSource(Config.ArchiveImageFolder, Config.ArchiveLabelFolder));
+      if(!ArchiveSource->Open(Config.SourceArchive))
+         return nullptr;
+      Source = std::move(ArchiveSource);
+      }
+   else
+      Source.reset(new CFolderImageSource(Config.ImagePath, Config.LabelPath, Config.SourceRecursive));
+
+   // The bands of the mapped files are read without the whole image in
+   // memory, and the tiles and the label index are taken straight from their rows.
+   Source->SetMapFiles(Config.BandHeight > 0 || Config.TileCopy == MIL_TEXT("rows"));
+   return Source;
+   }
+
+CFolderImageSource::CFolderImageSource(const MIL_STRING& ImagePath, const MIL_STRING& LabelPath, bool Recursive)
+   : m_ImagePath(ImagePath),
+     m_LabelPath(LabelPath),
+     m_Recursive(Recursive)
+   {
+   }
+
+void CFolderImageSource::ListImages(std::vector<MIL_STRING>& FileNames)
+   {
+   CDirectoryListing Listing;
+   Listing.Scan(m_ImagePath, MIL_TEXT(".bmp"), m_Recursive);
+
+   FileNames.resize((std::size_t)Listing.NumberOfFiles());
+   for(MIL_INT i = 0; i < Listing.NumberOfFiles(); i++)
+      FileNames[(std::size_t)i] = Listing.FileName(i);
+
+   // Sort the files so that every process builds the same dataset, whatever
+   // the order in which the file system enumerates them.
+   std::sort(FileNames.begin(), FileNames.end());
+   }
+
+bool CFolderImageSource::OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   return Reader.Open(MilSystem, m_ImagePath + FileName, m_MapFiles);
+   }
+
+bool CFolderImageSource::OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   return Reader.Open(MilSystem, m_LabelPath + FileName, m_MapFiles);
+   }
+
+bool CFolderImageSource::GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key)
+   {
+   return HashFileStamp(m_LabelPath + FileName, Key);
+   }
+
+CArchiveImageSource::CArchiveImageSource(const MIL_STRING& ImageFolder, const MIL_STRING& LabelFolder)
+   : m_ImageFolder(ImageFolder),
+     m_LabelFolder(LabelFolder)
+   {
+   // The archive entries always use forward slashes.
+   std::replace(m_ImageFolder.begin(), m_ImageFolder.end(), MIL_TEXT('\\'), MIL_TEXT('/'));
+   std::replace(m_LabelFolder.begin(), m_LabelFolder.end(), MIL_TEXT('\\'), MIL_TEXT('/'));
+   if(!m_ImageFolder.empty() && m_ImageFolder.back() != MIL_TEXT('/'))
+      m_ImageFolder += MIL_TEXT('/');
+   if(!m_LabelFolder.empty() && m_LabelFolder.back() != MIL_TEXT('/'))
+      m_LabelFolder += MIL_TEXT('/');
+   }
+
+bool CArchiveImageSource::Open(const MIL_STRING& ArchiveFile)
+   {
+   if(!m_Archive.Open(ArchiveFile))
+      {
+      MosPrintf(MIL_TEXT("Unable to read the zip archive %s.\n"), ArchiveFile.c_str());
+      return false;
+      }
+   return true;
+   }
+
+// Lists the .bmp entries of the image folder that have a label. The archive
+// entries are sorted by name, so the list is sorted as well.
+void CArchiveImageSource::ListImages(std::vector<MIL_STRING>& FileNames)
+   {
+   static const MIL_STRING Extension = MIL_TEXT(".bmp");
+
+   FileNames.clear();
+   for(MIL_INT i = 0; i < m_Archive.NumberOfEntries(); i++)
+      {
+      const MIL_STRING& EntryName = m_Archive.EntryName(i);
+      if(EntryName.size() <= m_ImageFolder.size() + Extension.size() ||
+         EntryName.compare(0, m_ImageFolder.size(), m_ImageFolder) != 0 ||
+         ToLowerString(EntryName.substr(EntryName.size() - Extension.size())) != Extension)
+         continue;
+
+      MIL_STRING FileName = EntryName.substr(m_ImageFolder.size());
+      if(m_Archive.FindEntry(m_LabelFolder + FileName) < 0)
+         {
+         MosPrintf(MIL_TEXT("No label for %s in the archive; the image is skipped.\n"), EntryName.c_str());
+         continue;
+         }
+      FileNames.push_back(FileName);
+      }
+   }
+
+bool CArchiveImageSource::OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   return OpenEntry(MilSystem, m_ImageFolder + FileName, m_ImageData, Reader);
+   }
+
+bool CArchiveImageSource::OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   return OpenEntry(MilSystem, m_LabelFolder + FileName, m_LabelData, Reader);
+   }
+
+// The archive already holds the CRC of each entry, so the label does not
+// need to be decompressed to be identified.
+bool CArchiveImageSource::GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key)
+   {
+   MIL_INT EntryIndex = m_Archive.FindEntry(m_LabelFolder + FileName);
+   if(EntryIndex < 0)
+      return false;
+
+   MIL_UINT8 CrcAndSize[8];
+   MIL_UINT32 Crc = m_Archive.EntryCrc(EntryIndex);
+   MIL_UINT32 Size = m_Archive.EntrySize(EntryIndex);
+   for(int i = 0; i < 4; i++)
+      {
+      CrcAndSize[i]     = (MIL_UINT8)(Crc >> (8 * i));
+      CrcAndSize[4 + i] = (MIL_UINT8)(Size >> (8 * i));
+      }
+   Key = HashBytes(CrcAndSize, sizeof(CrcAndSize), 0);
+   return true;
+   }
+
+bool CArchiveImageSource::OpenEntry(MIL_ID MilSystem, const MIL_STRING& EntryName, std::vector<MIL_UINT8>& Data, CImageBandReader& Reader)
+   {
+   MIL_INT EntryIndex = m_Archive.FindEntry(EntryName);
+   if(EntryIndex < 0 || !m_Archive.ReadEntry(EntryIndex, Data))
+      {
+      MosPrintf(MIL_TEXT("Unable to read %s from the archive.\n"), EntryName.c_str());
+      return false;
+      }
+
+   if(!Reader.Open(MilSystem, Data.data(), Data.size()))
+      {
+      MosPrintf(MIL_TEXT("Unsupported image format for %s; only uncompressed 8-bit TIFF and BMP are read from archives.\n"), EntryName.c_str());
+      return false;
+      }
+   return true;
+   }
+
+namespace
+   {
+   // Splits a CSV line into its fields. Quoted fields can hold commas and
+   // doubled quotes.
+   std::vector<MIL_STRING> SplitCsvLine(const MIL_STRING& Line)
+      {
+      std::vector<MIL_STRING> Fields(1);
+      bool InQuotes = false;
+      for(std::size_t i = 0; i < Line.size(); i++)
+         {
+         MIL_TEXT_CHAR Char = Line[i];
+         if(InQuotes)
+            {
+            if(Char != MIL_TEXT('"'))
+               Fields.back() += Char;
+            else if(i + 1 < Line.size() && Line[i + 1] == MIL_TEXT('"'))
+               Fields.back() += Line[++i];
+            else
+               InQuotes = false;
+            }
+         else if(Char == MIL_TEXT('"'))
+            InQuotes = true;
+         else if(Char == MIL_TEXT(','))
+            Fields.emplace_back();
+         else
+            Fields.back() += Char;
+         }
+      for(auto& Field : Fields)
+         Field = TrimString(Field);
+      return Fields;
+      }
+
+   // Reads the string value of a top-level field of a one-line JSON object.
+   bool ReadJsonString(const MIL_STRING& Line, const MIL_STRING& Key, MIL_STRING& Value)
+      {
+      std::size_t Pos = Line.find(MIL_TEXT("\"") + Key + MIL_TEXT("\""));
+      if(Pos == MIL_STRING::npos)
+         return false;
+      Pos = Line.find_first_not_of(MIL_TEXT(" \t"), Pos + Key.size() + 2);
+      if(Pos == MIL_STRING::npos || Line[Pos] != MIL_TEXT(':'))
+         return false;
+      Pos = Line.find_first_not_of(MIL_TEXT(" \t"), Pos + 1);
+      if(Pos == MIL_STRING::npos || Line[Pos] != MIL_TEXT('"'))
+         return false;
+
+      Value.clear();
+      for(Pos++; Pos < Line.size(); Pos++)
+         {
+         MIL_TEXT_CHAR Char = Line[Pos];
+         if(Char == MIL_TEXT('"'))
+            return true;
+         if(Char != MIL_TEXT('\\'))
+            {
+            Value += Char;
+            continue;
+            }
+         if(++Pos == Line.size())
+            return false;
+         switch(Line[Pos])
+            {
+            case MIL_TEXT('n'): Value += MIL_TEXT('\n'); break;
+            case MIL_TEXT('t'): Value += MIL_TEXT('\t'); break;
+            case MIL_TEXT('u'):
+               if(Pos + 4 >= Line.size())
+                  return false;
+               Value += (MIL_TEXT_CHAR)std::stoul(Line.substr(Pos + 1, 4), nullptr, 16);
+               Pos += 4;
+               break;
+            default: Value += Line[Pos]; break; // \", \\ and \/.
+            }
+         }
+      return false;
+      }
+   }
+
+bool CManifestImageSource::Open(const MIL_STRING& ManifestFile)
+   {
+   CMappedFile File;
+   if(!File.Open(ManifestFile))
+      {
+      MosPrintf(MIL_TEXT("Unable to open the manifest %s.\n"), ManifestFile.c_str());
+      return false;
+      }
+
+   std::size_t SeparatorPos = ManifestFile.find_last_of(MIL_TEXT("\\/"));
+   m_BaseFolder = SeparatorPos == MIL_STRING::npos ? MIL_STRING() : ManifestFile.substr(0, SeparatorPos + 1);
+
+   // The manifest is expected to be ASCII (or UTF-8 restricted to ASCII in the paths).
+   const MIL_UINT8* Data = File.Data();
+   std::size_t LineStart = 0;
+   MIL_INT LineNumber = 0;
+   while(LineStart < File.Size())
+      {
+      const MIL_UINT8* LineEnd = std::find(Data + LineStart, Data + File.Size(), (MIL_UINT8)'\n');
+      std::size_t LineLength = (std::size_t)(LineEnd - (Data + LineStart));
+      MIL_STRING Line = TrimString(MIL_STRING(Data + LineStart, Data + LineStart + LineLength));
+      LineStart += LineLength + 1;
+      LineNumber++;
+
+      if(Line.empty() || Line[0] == MIL_TEXT('#'))
+         continue;
+
+      MIL_STRING ImageFile, LabelFile, Group;
+      bool IsValid;
+      if(Line[0] == MIL_TEXT('{'))
+         {
+         try
+            {
+            IsValid = ReadJsonString(Line, MIL_TEXT("image"), ImageFile) && ReadJsonString(Line, MIL_TEXT("label"), LabelFile);
+            if(IsValid && !ReadJsonString(Line, MIL_TEXT("group"), Group))
+               Group.clear();
+            }
+         catch(const std::exception&)
+            {
+            IsValid = false;
+            }
+         }
+      else
+         {
+         std::vector<MIL_STRING> Fields = SplitCsvLine(Line);
+         IsValid = Fields.size() >= 2;
+         if(IsValid)
+            {
+            // Skip the header line.
+            if(m_Images.empty() && ToLowerString(Fields[0]) == MIL_TEXT("image"))
+               continue;
+            ImageFile = Fields[0];
+            LabelFile = Fields[1];
+            if(Fields.size() >= 3)
+               Group = Fields[2];
+            }
+         }
+
+      if(!IsValid || ImageFile.empty() || LabelFile.empty())
+         {
+         MosPrintf(MIL_TEXT("%s(%d): expected an image and a label.\n"), ManifestFile.c_str(), (int)LineNumber);
+         return false;
+         }
+      if(!m_ImageIndices.emplace(ImageFile, m_Images.size()).second)
+         {
+         MosPrintf(MIL_TEXT("%s(%d): %s is listed twice; the duplicate is skipped.\n"), ManifestFile.c_str(), (int)LineNumber, ImageFile.c_str());
+         continue;
+         }
+      m_Images.push_back(ImageFile);
+      m_Labels.push_back(LabelFile);
+      m_Groups.push_back(Group);
+      }
+   return true;
+   }
+
+void CManifestImageSource::ListImages(std::vector<MIL_STRING>& FileNames)
+   {
+   // The order of the manifest is kept.
+   FileNames = m_Images;
+   }
+
+bool CManifestImageSource::OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   return Reader.Open(MilSystem, ResolvePath(FileName), m_MapFiles);
+   }
+
+bool CManifestImageSource::OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader)
+   {
+   MIL_STRING LabelPath;
+   return FindLabelPath(FileName, LabelPath) && Reader.Open(MilSystem, LabelPath, m_MapFiles);
+   }
+
+bool CManifestImageSource::GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key)
+   {
+   MIL_STRING LabelPath;
+   return FindLabelPath(FileName, LabelPath) && HashFileStamp(LabelPath, Key);
+   }
+
+bool CManifestImageSource::GetImageGroup(const MIL_STRING& FileName, MIL_STRING& Group)
+   {
+   auto It = m_ImageIndices.find(FileName);
+   if(It == m_ImageIndices.end() || m_Groups[It->second].empty())
+      return false;
+   Group = m_Groups[It->second];
+   return true;
+   }
+
+bool CManifestImageSource::FindLabelPath(const MIL_STRING& FileName, MIL_STRING& LabelPath) const
+   {
+   auto It = m_ImageIndices.find(FileName);
+   if(It == m_ImageIndices.end())
+      {
+      MosPrintf(MIL_TEXT("%s is not in the manifest.\n"), FileName.c_str());
+      return false;
+      }
+   LabelPath = ResolvePath(m_Labels[It->second]);
+   return true;
+   }
+
+// Absolute paths are used as they are, the others are relative to the folder
+// of the manifest.
+MIL_STRING CManifestImageSource::ResolvePath(const MIL_STRING& Path) const
+   {
+   bool IsAbsolute = (!Path.empty() && (Path[0] == MIL_TEXT('\\') || Path[0] == MIL_TEXT('/'))) ||
+                     (Path.size() > 1 && Path[1] == MIL_TEXT(':'));
+   return IsAbsolute ? Path : m_BaseFolder + Path;
+   }
@@ -0,0 +1,116 @@
+﻿//*************************************************************************************
+//
+// File name: ImageSources.h
+//
+// Synopsis:  Sources of the image/label pairs: folders, manifests (CSV or JSONL) and
+//            zip archives.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include "DataPrepConfig.h"
+#include "ZipArchive.h"
+#include "RasterImage.h"
+#include <memory>
+#include <unordered_map>
+
+// Source of the image/label pairs from which the tiles are extracted.
+class CImageSource
+   {
+   public:
+      virtual ~CImageSource() {}
+
+      // Lists the names of the source images, relative to the source, in an
+      // order that is the same in every process.
+      virtual void ListImages(std::vector<MIL_STRING>& FileNames) = 0;
+
+      // Opens a source image, or its label image, to read it band by band.
+      virtual bool OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) = 0;
+      virtual bool OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) = 0;
+
+      // Returns a key that identifies the content of the label image of a
+      // source image, without decoding it, for the label cache.
+      virtual bool GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key) = 0;
+
+      // Returns the group of a source image, for the group split, when the
+      // source defines one.
+      virtual bool GetImageGroup(const MIL_STRING& FileName, MIL_STRING& Group) { return false; }
+
+      // Maps the uncompressed image files rather than restoring them whole,
+      // to process very large images band by band.
+      void SetMapFiles(bool MapFiles) { m_MapFiles = MapFiles; }
+
+   protected:
+      bool m_MapFiles = false;
+   };
+
+// Images and labels in two folders, or folder trees, under the same names.
+class CFolderImageSource : public CImageSource
+   {
+   public:
+      CFolderImageSource(const MIL_STRING& ImagePath, const MIL_STRING& LabelPath, bool Recursive);
+
+      void ListImages(std::vector<MIL_STRING>& FileNames) override;
+      bool OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key) override;
+
+   private:
+      MIL_STRING m_ImagePath;
+      MIL_STRING m_LabelPath;
+      bool       m_Recursive;
+   };
+
+// Image/label pairs listed in a manifest. A CSV manifest has one
+// "image,label" line per pair, with an optional header line; a JSONL
+// manifest has one {"image": ..., "label": ...} object per line. Other
+// columns or fields are ignored.
+class CManifestImageSource : public CImageSource
+   {
+   public:
+      bool Open(const MIL_STRING& ManifestFile);
+
+      void ListImages(std::vector<MIL_STRING>& FileNames) override;
+      bool OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key) override;
+      bool GetImageGroup(const MIL_STRING& FileName, MIL_STRING& Group) override;
+
+   private:
+      MIL_STRING ResolvePath(const MIL_STRING& Path) const;
+      bool FindLabelPath(const MIL_STRING& FileName, MIL_STRING& LabelPath) const;
+
+      MIL_STRING                                  m_BaseFolder;
+      std::vector<MIL_STRING>                     m_Images;
+      std::vector<MIL_STRING>                     m_Labels;
+      std::vector<MIL_STRING>                     m_Groups;     // Empty for the images without a group.
+      std::unordered_map<MIL_STRING, std::size_t> m_ImageIndices;
+   };
+
+// Images and labels in two folders of a zip archive, streamed from the
+// archive without extracting it on disk.
+class CArchiveImageSource : public CImageSource
+   {
+   public:
+      CArchiveImageSource(const MIL_STRING& ImageFolder, const MIL_STRING& LabelFolder);
+
+      bool Open(const MIL_STRING& ArchiveFile);
+
+      void ListImages(std::vector<MIL_STRING>& FileNames) override;
+      bool OpenImage(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool OpenLabel(MIL_ID MilSystem, const MIL_STRING& FileName, CImageBandReader& Reader) override;
+      bool GetLabelKey(const MIL_STRING& FileName, MIL_UINT64& Key) override;
+
+   private:
+      bool OpenEntry(MIL_ID MilSystem, const MIL_STRING& EntryName, std::vector<MIL_UINT8>& Data, CImageBandReader& Reader);
+
+      CZipArchive            m_Archive;
+      MIL_STRING             m_ImageFolder;
+      MIL_STRING             m_LabelFolder;
+      std::vector<MIL_UINT8> m_ImageData;   // Decompressed entries, reused from
+      std::vector<MIL_UINT8> m_LabelData;   // one pair to the next.
+   };
+
+std::unique_ptr<CImageSource> CreateImageSource(const SDataPrepConfig& Config);
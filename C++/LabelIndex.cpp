@@ -0,0 +1,680 @@
+﻿//*************************************************************************************
+//
+// File name: LabelIndex.cpp
+//
+// Synopsis:  Sparse index of the label images, that skips their empty blocks, its
+//            cache on disk across runs, and the SIMD counts of the label values.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "LabelIndex.h"
+#include <algorithm>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#endif
+
+void CLabelBlockIndex::Build(CImageBandReader& Label, MIL_INT BandHeight)
+   {
+   BeginBuild(Label.SizeX(), Label.SizeY());
+
+   // The rows of a mapped gray label are indexed in place, without any copy.
+   if(Label.IsMapped() && Label.SizeBand() == 1)
+      {
+      for(MIL_INT y = 0; y < m_SizeY; y++)
+         AddRow(y, Label.Row(y));
+      return;
+      }
+
+   if(BandHeight <= 0)
+      BandHeight = m_SizeY;
+
+   for(MIL_INT BandY = 0; BandY < m_SizeY; BandY += BandHeight)
+      {
+      MIL_INT NbRows = std::min<MIL_INT>(BandHeight, m_SizeY - BandY);
+      MIL_ID Band = Label.ReadBand(BandY, NbRows);
+      m_Rows.resize((std::size_t)(m_SizeX * NbRows));
+      MbufGetColor2d(Band, M_SINGLE_BAND, 0, 0, 0, m_SizeX, NbRows, m_Rows.data());
+      for(MIL_INT Row = 0; Row < NbRows; Row++)
+         AddRow(BandY + Row, &m_Rows[(std::size_t)(Row * m_SizeX)]);
+      }
+   }
+
+void CLabelBlockIndex::BeginBuild(MIL_INT SizeX, MIL_INT SizeY)
+   {
+   m_SizeX = SizeX;
+   m_SizeY = SizeY;
+   m_NbBlocksX = (m_SizeX + BLOCK_SIZE - 1) / BLOCK_SIZE;
+   m_NbBlocksY = (m_SizeY + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+   const SBlockBox EmptyBox = {m_NbBlocksX, m_NbBlocksY, -1, -1};
+   m_BlockMax.assign((std::size_t)(m_NbBlocksX * m_NbBlocksY), 0);
+   m_BlockPixelIndices.assign((std::size_t)(m_NbBlocksX * m_NbBlocksY), -1);
+   m_BlockPixels.clear();
+   m_ValueBoxes.assign((std::size_t)NB_LABEL_VALUES, EmptyBox);
+   m_HasBlobCenters = false;
+   }
+
+// Adds the rows in order. The pixels of a block are only stored once a
+// non-zero pixel is found in it.
+void CLabelBlockIndex::AddRow(MIL_INT y, const MIL_UINT8* Row)
+   {
+   MIL_INT BlockY = y / BLOCK_SIZE;
+   MIL_INT RowInBlock = y % BLOCK_SIZE;
+   for(MIL_INT BlockX = 0; BlockX < m_NbBlocksX; BlockX++)
+      {
+      MIL_INT StartX = BlockX * BLOCK_SIZE;
+      MIL_INT EndX = std::min<MIL_INT>(StartX + BLOCK_SIZE, m_SizeX);
+      MIL_UINT8 RowMax = 0;
+      for(MIL_INT x = StartX; x < EndX; x++)
+         RowMax = std::max(RowMax, Row[x]);
+      if(RowMax == 0)
+         continue;
+
+      std::size_t Block = (std::size_t)(BlockY * m_NbBlocksX + BlockX);
+      if(m_BlockPixelIndices[Block] < 0)
+         {
+         m_BlockPixelIndices[Block] = (MIL_INT32)(m_BlockPixels.size() / BLOCK_AREA);
+         m_BlockPixels.resize(m_BlockPixels.size() + BLOCK_AREA, 0);
+         }
+      std::copy(Row + StartX, Row + EndX, const_cast<MIL_UINT8*>(BlockRow(Block, RowInBlock)));
+      m_BlockMax[Block] = std::max(m_BlockMax[Block], RowMax);
+
+      // Only the rare non-zero pixels update the boxes of their values.
+      for(MIL_INT x = StartX; x < EndX; x++)
+         {
+         if(Row[x] == 0)
+            continue;
+         SBlockBox& Box = m_ValueBoxes[Row[x]];
+         Box.MinX = std::min(Box.MinX, BlockX);
+         Box.MinY = std::min(Box.MinY, BlockY);
+         Box.MaxX = std::max(Box.MaxX, BlockX);
+         Box.MaxY = std::max(Box.MaxY, BlockY);
+         }
+      }
+   }
+
+// The blobs of each value are only searched in the blocks where it appears,
+// and the bands without any of them are not read.
+void CLabelBlockIndex::ComputeBlobCenters(CImageBandReader& Label, MIL_INT BandHeight, MIL_INT BandOverlap)
+   {
+   if(BandHeight <= 0)
+      BandHeight = m_SizeY;
+
+   m_BlobCentersX.assign((std::size_t)NB_LABEL_VALUES, std::vector<MIL_INT>());
+   m_BlobCentersY.assign((std::size_t)NB_LABEL_VALUES, std::vector<MIL_INT>());
+   std::vector<MIL_INT> CentersX, CentersY, BoxesMinY;
+   for(MIL_INT BandY = 0; BandY < m_SizeY; BandY += BandHeight)
+      {
+      // The analyzed rows start one row above the band, so that the blobs
+      // that started in the previous band are seen to do so.
+      MIL_INT StartY = std::max<MIL_INT>(BandY - 1, 0);
+      MIL_INT EndY = std::min<MIL_INT>(BandY + BandHeight + BandOverlap, m_SizeY);
+      MIL_ID Band = M_NULL;
+
+      for(MIL_INT Value = 1; Value < NB_LABEL_VALUES; Value++)
+         {
+         MIL_INT BoxX, BoxY, BoxSizeX, BoxSizeY;
+         if(!GetValueBox(Value, BoxX, BoxY, BoxSizeX, BoxSizeY))
+            continue;
+         MIL_INT BoxStartY = std::max(BoxY, StartY);
+         MIL_INT BoxEndY = std::min(BoxY + BoxSizeY, EndY);
+         if(BoxStartY >= BoxEndY || BoxY + BoxSizeY <= BandY || BoxY >= BandY + BandHeight)
+            continue;
+
+         if(Band == M_NULL)
+            {
+            Band = Label.ReadBand(StartY, EndY - StartY);
+
+            MIL_ID MilSystem = MbufInquire(Band, M_OWNER_SYSTEM, M_NULL);
+            if(!m_BlobContext)
+               {
+               m_BlobContext = MblobAlloc(MilSystem, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
+               m_BlobResult = MblobAllocResult(MilSystem, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
+               MblobControl(m_BlobContext, M_CENTER_OF_GRAVITY, M_ENABLE);
+               MblobControl(m_BlobContext, M_BOX, M_ENABLE);
+               }
+            if(!m_BinLabel || MbufInquire(m_BinLabel, M_SIZE_X, M_NULL) < m_SizeX || MbufInquire(m_BinLabel, M_SIZE_Y, M_NULL) < EndY - StartY)
+               m_BinLabel = MbufAlloc2d(MilSystem, m_SizeX, EndY - StartY, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+            }
+
+         auto MilLabelBox = MbufChild2d(Band, BoxX, BoxStartY - StartY, BoxSizeX, BoxEndY - BoxStartY, M_UNIQUE_ID);
+         auto MilBinLabelBox = MbufChild2d(m_BinLabel, 0, 0, BoxSizeX, BoxEndY - BoxStartY, M_UNIQUE_ID);
+
+         MimBinarize(MilLabelBox, MilBinLabelBox, M_FIXED + M_EQUAL, (MIL_DOUBLE)Value, M_NULL);
+         MblobCalculate(m_BlobContext, MilBinLabelBox, M_NULL, m_BlobResult);
+
+         MIL_INT NbBlobs;
+         MblobGetResult(m_BlobResult, M_DEFAULT, M_NUMBER + M_TYPE_MIL_INT, &NbBlobs);
+         CentersX.resize((std::size_t)NbBlobs);
+         CentersY.resize((std::size_t)NbBlobs);
+         BoxesMinY.resize((std::size_t)NbBlobs);
+         MblobGetResult(m_BlobResult, M_DEFAULT, M_CENTER_OF_GRAVITY_X, CentersX);
+         MblobGetResult(m_BlobResult, M_DEFAULT, M_CENTER_OF_GRAVITY_Y, CentersY);
+         MblobGetResult(m_BlobResult, M_DEFAULT, M_BOX_Y_MIN, BoxesMinY);
+
+         for(std::size_t i = 0; i < CentersX.size(); i++)
+            {
+            MIL_INT TopY = BoxesMinY[i] + BoxStartY;
+            if(TopY < BandY || TopY >= BandY + BandHeight)
+               continue;
+            m_BlobCentersX[(std::size_t)Value].push_back(CentersX[i] + BoxX);
+            m_BlobCentersY[(std::size_t)Value].push_back(CentersY[i] + BoxStartY);
+            }
+         }
+      }
+   m_HasBlobCenters = true;
+   }
+
+const std::vector<MIL_INT>& CLabelBlockIndex::BlobCentersX(MIL_INT Value) const
+   {
+   static const std::vector<MIL_INT> NoCenters;
+   return (Value > 0 && Value < NB_LABEL_VALUES) ? m_BlobCentersX[(std::size_t)Value] : NoCenters;
+   }
+
+const std::vector<MIL_INT>& CLabelBlockIndex::BlobCentersY(MIL_INT Value) const
+   {
+   static const std::vector<MIL_INT> NoCenters;
+   return (Value > 0 && Value < NB_LABEL_VALUES) ? m_BlobCentersY[(std::size_t)Value] : NoCenters;
+   }
+
+bool CLabelBlockIndex::GetValueBox(MIL_INT Value, MIL_INT& OffsetX, MIL_INT& OffsetY, MIL_INT& SizeX, MIL_INT& SizeY) const
+   {
+   if(Value < 0 || Value >= NB_LABEL_VALUES || m_ValueBoxes.empty())
+      return false;
+
+   const SBlockBox& Box = m_ValueBoxes[(std::size_t)Value];
+   if(Box.MaxX < 0)
+      return false;
+
+   OffsetX = Box.MinX * BLOCK_SIZE;
+   OffsetY = Box.MinY * BLOCK_SIZE;
+   SizeX = std::min<MIL_INT>((Box.MaxX + 1) * BLOCK_SIZE, m_SizeX) - OffsetX;
+   SizeY = std::min<MIL_INT>((Box.MaxY + 1) * BLOCK_SIZE, m_SizeY) - OffsetY;
+   return true;
+   }
+
+MIL_DOUBLE CLabelBlockIndex::GetRegionMax(MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY) const
+   {
+   MIL_INT StartX = std::max<MIL_INT>(OffsetX, 0);
+   MIL_INT StartY = std::max<MIL_INT>(OffsetY, 0);
+   MIL_INT EndX = std::min<MIL_INT>(OffsetX + SizeX, m_SizeX);
+   MIL_INT EndY = std::min<MIL_INT>(OffsetY + SizeY, m_SizeY);
+   if(StartX >= EndX || StartY >= EndY)
+      return 0.0;
+
+   MIL_INT FirstBlockX = StartX / BLOCK_SIZE, LastBlockX = (EndX - 1) / BLOCK_SIZE;
+   MIL_INT FirstBlockY = StartY / BLOCK_SIZE, LastBlockY = (EndY - 1) / BLOCK_SIZE;
+
+   // The blocks entirely inside the region first, so that the border blocks
+   // whose maximum is not greater are skipped.
+   MIL_UINT8 Max = 0;
+   for(MIL_INT BlockY = FirstBlockY; BlockY <= LastBlockY; BlockY++)
+      {
+      bool InsideY = BlockY * BLOCK_SIZE >= StartY && std::min<MIL_INT>((BlockY + 1) * BLOCK_SIZE, m_SizeY) <= EndY;
+      for(MIL_INT BlockX = FirstBlockX; BlockX <= LastBlockX && InsideY; BlockX++)
+         {
+         if(BlockX * BLOCK_SIZE >= StartX && std::min<MIL_INT>((BlockX + 1) * BLOCK_SIZE, m_SizeX) <= EndX)
+            Max = std::max(Max, m_BlockMax[(std::size_t)(BlockY * m_NbBlocksX + BlockX)]);
+         }
+      }
+
+   for(MIL_INT BlockY = FirstBlockY; BlockY <= LastBlockY; BlockY++)
+      {
+      for(MIL_INT BlockX = FirstBlockX; BlockX <= LastBlockX; BlockX++)
+         {
+         std::size_t Block = (std::size_t)(BlockY * m_NbBlocksX + BlockX);
+         if(m_BlockMax[Block] <= Max)
+            continue;
+
+         // The block crosses the border of the region: only its part inside the region is read.
+         MIL_INT BlockStartX = std::max<MIL_INT>(BlockX * BLOCK_SIZE, StartX) - BlockX * BLOCK_SIZE;
+         MIL_INT BlockEndX = std::min<MIL_INT>((BlockX + 1) * BLOCK_SIZE, EndX) - BlockX * BLOCK_SIZE;
+         MIL_INT BlockStartY = std::max<MIL_INT>(BlockY * BLOCK_SIZE, StartY) - BlockY * BLOCK_SIZE;
+         MIL_INT BlockEndY = std::min<MIL_INT>((BlockY + 1) * BLOCK_SIZE, EndY) - BlockY * BLOCK_SIZE;
+         for(MIL_INT y = BlockStartY; y < BlockEndY; y++)
+            {
+            const MIL_UINT8* Row = BlockRow(Block, y);
+            for(MIL_INT x = BlockStartX; x < BlockEndX; x++)
+               Max = std::max(Max, Row[x]);
+            }
+         }
+      }
+   return (MIL_DOUBLE)Max;
+   }
+
+void CLabelBlockIndex::CountRegionValues(MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY,
+                                         const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts) const
+   {
+   if(SizeX <= 0 || SizeY <= 0)
+      return;
+
+   // The pixels that are not read, outside of the image or in the empty
+   // blocks, are all background.
+   MIL_INT NbBackground = SizeX * SizeY;
+   MIL_INT StartX = std::max<MIL_INT>(OffsetX, 0);
+   MIL_INT StartY = std::max<MIL_INT>(OffsetY, 0);
+   MIL_INT EndX = std::min<MIL_INT>(OffsetX + SizeX, m_SizeX);
+   MIL_INT EndY = std::min<MIL_INT>(OffsetY + SizeY, m_SizeY);
+   bool InsideImage = StartX < EndX && StartY < EndY;
+   for(MIL_INT BlockY = StartY / BLOCK_SIZE; InsideImage && BlockY * BLOCK_SIZE < EndY; BlockY++)
+      {
+      for(MIL_INT BlockX = StartX / BLOCK_SIZE; BlockX * BLOCK_SIZE < EndX; BlockX++)
+         {
+         std::size_t Block = (std::size_t)(BlockY * m_NbBlocksX + BlockX);
+         if(m_BlockPixelIndices[Block] < 0)
+            continue;
+
+         MIL_INT BlockStartX = std::max<MIL_INT>(BlockX * BLOCK_SIZE, StartX) - BlockX * BLOCK_SIZE;
+         MIL_INT BlockEndX = std::min<MIL_INT>((BlockX + 1) * BLOCK_SIZE, EndX) - BlockX * BLOCK_SIZE;
+         MIL_INT BlockStartY = std::max<MIL_INT>(BlockY * BLOCK_SIZE, StartY) - BlockY * BLOCK_SIZE;
+         MIL_INT BlockEndY = std::min<MIL_INT>((BlockY + 1) * BLOCK_SIZE, EndY) - BlockY * BLOCK_SIZE;
+         NbBackground -= (BlockEndX - BlockStartX) * (BlockEndY - BlockStartY);
+
+         // The rows of a block are contiguous: the whole width is counted at once.
+         if(BlockStartX == 0 && BlockEndX == BLOCK_SIZE)
+            {
+            CountLabelValues(BlockRow(Block, BlockStartY), (std::size_t)((BlockEndY - BlockStartY) * BLOCK_SIZE), Values, NbValues, Counts);
+            continue;
+            }
+         for(MIL_INT y = BlockStartY; y < BlockEndY; y++)
+            CountLabelValues(BlockRow(Block, y) + BlockStartX, (std::size_t)(BlockEndX - BlockStartX), Values, NbValues, Counts);
+         }
+      }
+
+   for(MIL_INT i = 0; i < NbValues; i++)
+      {
+      if(Values[i] == 0)
+         Counts[i] += NbBackground;
+      }
+   }
+
+namespace
+   {
+   typedef void (*CountLabelValuesFunction)(const MIL_UINT8*, std::size_t, const MIL_INT*, MIL_INT, MIL_INT*);
+
+   void CountLabelValuesScalar(const MIL_UINT8* Pixels, std::size_t NbPixels, const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts)
+      {
+      for(std::size_t i = 0; i < NbPixels; i++)
+         {
+         for(MIL_INT v = 0; v < NbValues; v++)
+            Counts[v] += (Pixels[i] == Values[v]) ? 1 : 0;
+         }
+      }
+
+#if defined(_M_IX86) || defined(_M_X64)
+   // The vector kernels compare the pixels with up to VALUES_PER_PASS values
+   // at a time, accumulating the matches in 8-bit lanes that are summed
+   // every 255 vectors, before they can overflow.
+   const MIL_INT VALUES_PER_PASS = 4;
+   const std::size_t VECTORS_PER_SUM = 255;
+
+   bool IsCountedValue(MIL_INT Value)
+      {
+      return Value >= 0 && Value <= 255;
+      }
+
+   MIL_INT SumBytes(__m128i Bytes)
+      {
+      __m128i Sums = _mm_sad_epu8(Bytes, _mm_setzero_si128());
+      return (MIL_INT)_mm_cvtsi128_si32(Sums) + (MIL_INT)_mm_cvtsi128_si32(_mm_srli_si128(Sums, 8));
+      }
+
+   void CountLabelValuesSse2(const MIL_UINT8* Pixels, std::size_t NbPixels, const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts)
+      {
+      const std::size_t NbVectors = NbPixels / sizeof(__m128i);
+      for(MIL_INT First = 0; First < NbValues; First += VALUES_PER_PASS)
+         {
+         __m128i Keys[VALUES_PER_PASS];
+         for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+            Keys[k] = _mm_set1_epi8((char)(First + k < NbValues ? Values[First + k] : 0));
+
+         for(std::size_t Vector = 0; Vector < NbVectors; )
+            {
+            std::size_t PassEnd = std::min(Vector + VECTORS_PER_SUM, NbVectors);
+            __m128i Matches[VALUES_PER_PASS];
+            for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+               Matches[k] = _mm_setzero_si128();
+            for(; Vector < PassEnd; Vector++)
+               {
+               __m128i Data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Pixels) + Vector);
+               for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+                  Matches[k] = _mm_sub_epi8(Matches[k], _mm_cmpeq_epi8(Data, Keys[k]));
+               }
+            for(MIL_INT k = 0; k < VALUES_PER_PASS && First + k < NbValues; k++)
+               {
+               if(IsCountedValue(Values[First + k]))
+                  Counts[First + k] += SumBytes(Matches[k]);
+               }
+            }
+         }
+
+      std::size_t NbDone = NbVectors * sizeof(__m128i);
+      CountLabelValuesScalar(Pixels + NbDone, NbPixels - NbDone, Values, NbValues, Counts);
+      }
+
+   // Compiled whatever the architecture option, and only called once the
+   // processor and the operating system are known to support AVX2.
+   void CountLabelValuesAvx2(const MIL_UINT8* Pixels, std::size_t NbPixels, const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts)
+      {
+      const std::size_t NbVectors = NbPixels / sizeof(__m256i);
+      for(MIL_INT First = 0; First < NbValues; First += VALUES_PER_PASS)
+         {
+         __m256i Keys[VALUES_PER_PASS];
+         for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+            Keys[k] = _mm256_set1_epi8((char)(First + k < NbValues ? Values[First + k] : 0));
+
+         for(std::size_t Vector = 0; Vector < NbVectors; )
+            {
+            std::size_t PassEnd = std::min(Vector + VECTORS_PER_SUM, NbVectors);
+            __m256i Matches[VALUES_PER_PASS];
+            for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+               Matches[k] = _mm256_setzero_si256();
+            for(; Vector < PassEnd; Vector++)
+               {
+               __m256i Data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Pixels) + Vector);
+               for(MIL_INT k = 0; k < VALUES_PER_PASS; k++)
+                  Matches[k] = _mm256_sub_epi8(Matches[k], _mm256_cmpeq_epi8(Data, Keys[k]));
+               }
+            for(MIL_INT k = 0; k < VALUES_PER_PASS && First + k < NbValues; k++)
+               {
+               if(!IsCountedValue(Values[First + k]))
+                  continue;
+               // The two halves are summed apart, each of their bytes can reach 255.
+               Counts[First + k] += SumBytes(_mm256_castsi256_si128(Matches[k])) +
+                                    SumBytes(_mm256_extracti128_si256(Matches[k], 1));
+               }
+            }
+         }
+      _mm256_zeroupper();
+
+      std::size_t NbDone = NbVectors * sizeof(__m256i);
+      CountLabelValuesSse2(Pixels + NbDone, NbPixels - NbDone, Values, NbValues, Counts);
+      }
+
+   bool IsAvx2Supported()
+      {
+      int Info[4];
+      __cpuid(Info, 0);
+      if(Info[0] < 7)
+         return false;
+
+      // AVX2 needs the operating system to save the YMM registers.
+      __cpuid(Info, 1);
+      const int OSXSAVE = 1 << 27, AVX = 1 << 28;
+      if((Info[2] & OSXSAVE) == 0 || (Info[2] & AVX) == 0 || (_xgetbv(0) & 6) != 6)
+         return false;
+
+      __cpuidex(Info, 7, 0);
+      const int AVX2 = 1 << 5;
+      return (Info[1] & AVX2) != 0;
+      }
+
+   CountLabelValuesFunction SelectCountLabelValues()
+      {
+      return IsAvx2Supported() ? CountLabelValuesAvx2 : CountLabelValuesSse2;
+      }
+#else
+   CountLabelValuesFunction SelectCountLabelValues()
+      {
+      return CountLabelValuesScalar;
+      }
+#endif
+   }
+
+void CountLabelValues(const MIL_UINT8* Pixels, std::size_t NbPixels, const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts)
+   {
+   // The kernel is chosen once, for the processor at hand.
+   static const CountLabelValuesFunction CountFunction = SelectCountLabelValues();
+   CountFunction(Pixels, NbPixels, Values, NbValues, Counts);
+   }
+
+namespace
+   {
+   const MIL_UINT32 LABEL_CACHE_MAGIC   = 0x434C5743;   // "CWLC"
+   const MIL_UINT32 LABEL_CACHE_VERSION = 1;
+
+   void AppendLe32(std::vector<MIL_UINT8>& Data, MIL_UINT32 Value)
+      {
+      for(int i = 0; i < 4; i++)
+         Data.push_back((MIL_UINT8)(Value >> (8 * i)));
+      }
+
+   // Variable-length unsigned integer, 7 bits per byte.
+   void AppendVarUInt(std::vector<MIL_UINT8>& Data, MIL_UINT64 Value)
+      {
+      while(Value >= 0x80)
+         {
+         Data.push_back((MIL_UINT8)(Value | 0x80));
+         Value >>= 7;
+         }
+      Data.push_back((MIL_UINT8)Value);
+      }
+
+   bool ReadVarUInt(const MIL_UINT8*& Data, const MIL_UINT8* End, MIL_UINT64& Value)
+      {
+      Value = 0;
+      for(int Shift = 0; Data < End && Shift < 64; Shift += 7)
+         {
+         MIL_UINT8 Byte = *Data++;
+         Value |= (MIL_UINT64)(Byte & 0x7F) << Shift;
+         if((Byte & 0x80) == 0)
+            return true;
+         }
+      return false;
+      }
+   }
+
+// Layout: magic, version, size X, size Y, the runs of the pixels as
+// (value, length) pairs, then the number of blob values and, for each value,
+// its number of blobs and their centers.
+void CLabelBlockIndex::Serialize(std::vector<MIL_UINT8>& Data) const
+   {
+   Data.clear();
+   AppendLe32(Data, LABEL_CACHE_MAGIC);
+   AppendLe32(Data, LABEL_CACHE_VERSION);
+   AppendLe32(Data, (MIL_UINT32)m_SizeX);
+   AppendLe32(Data, (MIL_UINT32)m_SizeY);
+
+   // The runs go on from one row to the next; the empty blocks are whole runs of background.
+   MIL_UINT8 RunValue = 0;
+   MIL_UINT64 RunLength = 0;
+   for(MIL_INT y = 0; y < m_SizeY; y++)
+      {
+      MIL_INT BlockY = y / BLOCK_SIZE;
+      for(MIL_INT BlockX = 0; BlockX < m_NbBlocksX; BlockX++)
+         {
+         std::size_t Block = (std::size_t)(BlockY * m_NbBlocksX + BlockX);
+         MIL_INT SegmentSize = std::min<MIL_INT>(BLOCK_SIZE, m_SizeX - BlockX * BLOCK_SIZE);
+         const MIL_UINT8* Row = m_BlockPixelIndices[Block] >= 0 ? BlockRow(Block, y % BLOCK_SIZE) : nullptr;
+         for(MIL_INT x = 0; x < SegmentSize; )
+            {
+            MIL_UINT8 Value = Row ? Row[x] : 0;
+            MIL_INT Length = 1;
+            if(!Row)
+               Length = SegmentSize;
+            if(RunLength > 0 && Value != RunValue)
+               {
+               Data.push_back(RunValue);
+               AppendVarUInt(Data, RunLength);
+               RunLength = 0;
+               }
+            RunValue = Value;
+            RunLength += (MIL_UINT64)Length;
+            x += Length;
+            }
+         }
+      }
+   if(RunLength > 0)
+      {
+      Data.push_back(RunValue);
+      AppendVarUInt(Data, RunLength);
+      }
+
+   MIL_UINT32 NbValues = 0;
+   for(MIL_INT Value = 1; Value < NB_LABEL_VALUES && m_HasBlobCenters; Value++)
+      NbValues += m_BlobCentersX[(std::size_t)Value].empty() ? 0 : 1;
+   AppendLe32(Data, NbValues);
+   for(MIL_INT Value = 1; Value < NB_LABEL_VALUES && m_HasBlobCenters; Value++)
+      {
+      const std::vector<MIL_INT>& CentersX = m_BlobCentersX[(std::size_t)Value];
+      const std::vector<MIL_INT>& CentersY = m_BlobCentersY[(std::size_t)Value];
+      if(CentersX.empty())
+         continue;
+      Data.push_back((MIL_UINT8)Value);
+      AppendVarUInt(Data, CentersX.size());
+      for(std::size_t i = 0; i < CentersX.size(); i++)
+         {
+         AppendVarUInt(Data, (MIL_UINT64)CentersX[i]);
+         AppendVarUInt(Data, (MIL_UINT64)CentersY[i]);
+         }
+      }
+   }
+
+bool CLabelBlockIndex::Deserialize(const MIL_UINT8* Data, std::size_t Size)
+   {
+   const MIL_UINT8* End = Data + Size;
+   if(Size < 16 || ReadLe32(Data) != LABEL_CACHE_MAGIC || ReadLe32(Data + 4) != LABEL_CACHE_VERSION)
+      return false;
+   m_SizeX = (MIL_INT)ReadLe32(Data + 8);
+   m_SizeY = (MIL_INT)ReadLe32(Data + 12);
+   Data += 16;
+   if(m_SizeX <= 0 || m_SizeY <= 0)
+      return false;
+
+   // The runs are decoded one row at a time into the index.
+   BeginBuild(m_SizeX, m_SizeY);
+   m_Rows.resize((std::size_t)m_SizeX);
+   MIL_INT x = 0, y = 0;
+   while(y < m_SizeY)
+      {
+      MIL_UINT64 RunLength;
+      if(Data >= End)
+         return false;
+      MIL_UINT8 Value = *Data++;
+      if(!ReadVarUInt(Data, End, RunLength) || RunLength == 0)
+         return false;
+      while(RunLength > 0)
+         {
+         if(y >= m_SizeY)
+            return false;
+         MIL_INT Length = (MIL_INT)std::min<MIL_UINT64>(RunLength, (MIL_UINT64)(m_SizeX - x));
+         std::fill(m_Rows.begin() + x, m_Rows.begin() + (x + Length), Value);
+         x += Length;
+         RunLength -= (MIL_UINT64)Length;
+         if(x == m_SizeX)
+            {
+            AddRow(y++, m_Rows.data());
+            x = 0;
+            }
+         }
+      }
+
+   if(End - Data < 4)
+      return false;
+   MIL_UINT32 NbValues = ReadLe32(Data);
+   Data += 4;
+   m_BlobCentersX.assign((std::size_t)NB_LABEL_VALUES, std::vector<MIL_INT>());
+   m_BlobCentersY.assign((std::size_t)NB_LABEL_VALUES, std::vector<MIL_INT>());
+   for(MIL_UINT32 v = 0; v < NbValues; v++)
+      {
+      MIL_UINT64 NbBlobs;
+      if(Data >= End)
+         return false;
+      MIL_UINT8 Value = *Data++;
+      if(!ReadVarUInt(Data, End, NbBlobs) || NbBlobs > (MIL_UINT64)(End - Data))
+         return false;
+      std::vector<MIL_INT>& CentersX = m_BlobCentersX[Value];
+      std::vector<MIL_INT>& CentersY = m_BlobCentersY[Value];
+      CentersX.resize((std::size_t)NbBlobs);
+      CentersY.resize((std::size_t)NbBlobs);
+      for(std::size_t i = 0; i < CentersX.size(); i++)
+         {
+         MIL_UINT64 X, Y;
+         if(!ReadVarUInt(Data, End, X) || !ReadVarUInt(Data, End, Y))
+            return false;
+         CentersX[i] = (MIL_INT)X;
+         CentersY[i] = (MIL_INT)Y;
+         }
+      }
+   m_HasBlobCenters = true;
+   return true;
+   }
+
+CLabelCache::CLabelCache(const MIL_STRING& Folder)
+   : m_Folder(Folder)
+   {
+   if(!m_Folder.empty() && m_Folder.back() != MIL_TEXT('\\') && m_Folder.back() != MIL_TEXT('/'))
+      m_Folder += MIL_TEXT('\\');
+   }
+
+MIL_STRING CLabelCache::EntryPath(MIL_UINT64 Key) const
+   {
+   MIL_TEXT_CHAR Name[32];
+   MosSprintf(Name, 32, MIL_TEXT("%08x%08x.lblidx"), (unsigned int)(Key >> 32), (unsigned int)Key);
+   return m_Folder + Name;
+   }
+
+bool CLabelCache::Load(MIL_UINT64 Key, CLabelBlockIndex& Index) const
+   {
+   CMappedFile File;
+   return IsEnabled() && File.Open(EntryPath(Key)) && Index.Deserialize(File.Data(), File.Size());
+   }
+
+// The entry is written under a temporary name and then renamed, so that the
+// processes that share the cache never read a partial entry.
+void CLabelCache::Save(MIL_UINT64 Key, const CLabelBlockIndex& Index)
+   {
+   if(!IsEnabled())
+      return;
+
+   Index.Serialize(m_Data);
+
+   MIL_STRING Path = EntryPath(Key);
+   MIL_TEXT_CHAR Suffix[32];
+   MosSprintf(Suffix, 32, MIL_TEXT(".%u.tmp"), (unsigned int)GetCurrentProcessId());
+   MIL_STRING TempPath = Path + Suffix;
+
+   HANDLE File = CreateFile(TempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if(File == INVALID_HANDLE_VALUE)
+      return;
+   DWORD Written = 0;
+   BOOL Success = WriteFile(File, m_Data.data(), (DWORD)m_Data.size(), &Written, NULL) && Written == (DWORD)m_Data.size();
+   CloseHandle(File);
+
+   if(!Success || !MoveFileEx(TempPath.c_str(), Path.c_str(), MOVEFILE_REPLACE_EXISTING))
+      DeleteFile(TempPath.c_str());
+   }
+
+bool RestoreLabelIndex(CImageSource& Source,
+                       MIL_ID MilSystem,
+                       const MIL_STRING& FileName,
+                       CLabelCache& Cache,
+                       bool NeedBlobCenters,
+                       MIL_INT BandHeight,
+                       MIL_INT BandOverlap,
+                       CLabelBlockIndex& LabelIndex)
+   {
+   // The blobs higher than the overlap are cut in bands, so the bands are
+   // part of the key of the cache entry.
+   MIL_UINT64 Key = 0;
+   bool UseCache = Cache.IsEnabled() && Source.GetLabelKey(FileName, Key);
+   if(UseCache && BandHeight > 0)
+      {
+      MIL_INT64 Bands[2] = {BandHeight, BandOverlap};
+      Key = HashBytes(reinterpret_cast<const MIL_UINT8*>(Bands), sizeof(Bands), Key);
+      }
+   if(UseCache && Cache.Load(Key, LabelIndex))
+      return true;
+
+   CImageBandReader Label;
+   if(!Source.OpenLabel(MilSystem, FileName, Label))
+      return false;
+
+   LabelIndex.Build(Label, BandHeight);
+   if(NeedBlobCenters || UseCache)
+      LabelIndex.ComputeBlobCenters(Label, BandHeight, BandOverlap);
+   if(UseCache)
+      Cache.Save(Key, LabelIndex);
+   return true;
+   }
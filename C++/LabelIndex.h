@@ -0,0 +1,131 @@
+﻿//*************************************************************************************
+//
+// File name: LabelIndex.h
+//
+// Synopsis:  Sparse index of the label images, that skips their empty blocks, its
+//            cache on disk across runs, and the SIMD counts of the label values.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include "RasterImage.h"
+#include "ImageSources.h"
+
+// Sparse index of a label image, built once when the label is restored: the
+// maximum label value of each block of BLOCK_SIZE x BLOCK_SIZE pixels, for
+// each label value the range of blocks in which it appears and, on request,
+// the centers of gravity of its blobs. The labels are mostly background, so
+// only the pixels of the non-empty blocks are kept, the extraction rarely has
+// to read them, and the index holds all that it needs from the label.
+class CLabelBlockIndex
+   {
+   public:
+      static const MIL_INT BLOCK_SIZE = 32;
+
+      // Builds the index from a label image read in bands of BandHeight rows
+      // (0 reads it whole), so that the whole label is never in memory.
+      void Build(CImageBandReader& Label, MIL_INT BandHeight);
+
+      // Computes the blobs of every label value, band by band. A blob belongs
+      // to the band in which it starts, and the blobs are analyzed up to
+      // BandOverlap rows below their band, so that only the blobs higher
+      // than the overlap are cut.
+      void ComputeBlobCenters(CImageBandReader& Label, MIL_INT BandHeight, MIL_INT BandOverlap);
+      bool HasBlobCenters() const { return m_HasBlobCenters; }
+      const std::vector<MIL_INT>& BlobCentersX(MIL_INT Value) const;
+      const std::vector<MIL_INT>& BlobCentersY(MIL_INT Value) const;
+
+      // Pixel bounding box of the blocks where the label value appears.
+      // Returns false if the value is not in the image.
+      bool GetValueBox(MIL_INT Value, MIL_INT& OffsetX, MIL_INT& OffsetY, MIL_INT& SizeX, MIL_INT& SizeY) const;
+
+      // Maximum label value of a region; the pixels outside of the image
+      // count as background. The blocks that lie entirely inside the region
+      // are not read, nor are the border blocks that cannot raise the maximum.
+      MIL_DOUBLE GetRegionMax(MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY) const;
+
+      // Adds to Counts[i] the number of pixels of a region whose label is
+      // Values[i]; the pixels outside of the image count as background. The
+      // empty blocks are counted without being read.
+      void CountRegionValues(MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY,
+                             const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts) const;
+
+      // Compact form of the index for the label cache: the pixels,
+      // run-length encoded, and the blob centers.
+      void Serialize(std::vector<MIL_UINT8>& Data) const;
+      bool Deserialize(const MIL_UINT8* Data, std::size_t Size);
+
+   private:
+      static const MIL_INT NB_LABEL_VALUES = 256;
+      static const MIL_INT BLOCK_AREA      = BLOCK_SIZE * BLOCK_SIZE;
+
+      struct SBlockBox
+         {
+         MIL_INT MinX, MinY, MaxX, MaxY;
+         };
+
+      void BeginBuild(MIL_INT SizeX, MIL_INT SizeY);
+      void AddRow(MIL_INT y, const MIL_UINT8* Row);
+
+      // Row of the pixels of a non-empty block.
+      const MIL_UINT8* BlockRow(std::size_t Block, MIL_INT RowInBlock) const
+         {
+         return &m_BlockPixels[(std::size_t)m_BlockPixelIndices[Block] * BLOCK_AREA + (std::size_t)(RowInBlock * BLOCK_SIZE)];
+         }
+
+      MIL_INT                           m_SizeX = 0;
+      MIL_INT                           m_SizeY = 0;
+      MIL_INT                           m_NbBlocksX = 0;
+      MIL_INT                           m_NbBlocksY = 0;
+      std::vector<MIL_UINT8>            m_BlockMax;
+      std::vector<MIL_INT32>            m_BlockPixelIndices;   // -1 for the empty blocks.
+      std::vector<MIL_UINT8>            m_BlockPixels;
+      std::vector<SBlockBox>            m_ValueBoxes;
+      std::vector<MIL_UINT8>            m_Rows;                // Reused from one band to the next.
+      bool                              m_HasBlobCenters = false;
+      std::vector<std::vector<MIL_INT>> m_BlobCentersX;
+      std::vector<std::vector<MIL_INT>> m_BlobCentersY;
+      MIL_UNIQUE_BLOB_ID                m_BlobContext;
+      MIL_UNIQUE_BLOB_ID                m_BlobResult;
+      MIL_UNIQUE_BUF_ID                 m_BinLabel;
+   };
+
+// On-disk cache of the label indices, shared by the runs: one file per label,
+// named after a key of the content of the label file, so that an edited label
+// gets a new entry and its stale one is no longer used. Without a folder, the
+// cache is disabled.
+class CLabelCache
+   {
+   public:
+      explicit CLabelCache(const MIL_STRING& Folder);
+
+      bool IsEnabled() const { return !m_Folder.empty(); }
+
+      bool Load(MIL_UINT64 Key, CLabelBlockIndex& Index) const;
+      void Save(MIL_UINT64 Key, const CLabelBlockIndex& Index);
+
+   private:
+      MIL_STRING EntryPath(MIL_UINT64 Key) const;
+
+      MIL_STRING             m_Folder;
+      std::vector<MIL_UINT8> m_Data;
+   };
+
+// Restores the label of a source image as a block index, from the cache when
+// it holds it. The blob centers are computed if requested, and always when the
+// index is saved to the cache, so that the cache entries are complete.
+bool RestoreLabelIndex(CImageSource& Source,
+                       MIL_ID MilSystem,
+                       const MIL_STRING& FileName,
+                       CLabelCache& Cache,
+                       bool NeedBlobCenters,
+                       MIL_INT BandHeight,
+                       MIL_INT BandOverlap,
+                       CLabelBlockIndex& LabelIndex);
+
+// Adds to Counts[i] the number of pixels equal to Values[i], all the values
+// being counted in a single pass over the pixels. Uses AVX2 or SSE2 when
+// available; the values outside of 0..255 are never found.
+void CountLabelValues(const MIL_UINT8* Pixels, std::size_t NbPixels, const MIL_INT* Values, MIL_INT NbValues, MIL_INT* Counts);
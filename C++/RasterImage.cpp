@@ -0,0 +1,424 @@
+﻿//*************************************************************************************
+//
+// File name: RasterImage.cpp
+//
+// Synopsis:  Uncompressed TIFF and BMP images decoded in place, the SIMD kernels that
+//            cut them into tiles, and the band by band reader of the source and label
+//            images.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "RasterImage.h"
+#include "DataPrepConfig.h"
+#include <algorithm>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace
+   {
+   // Reads a value of a TIFF field, of type SHORT or LONG, in the byte order
+   // of the file. The values fit in the field itself when they are small.
+   struct STiffReader
+      {
+      const MIL_UINT8* Data;
+      std::size_t      Size;
+      bool             IsBigEndian;
+
+      MIL_UINT32 Read16(std::size_t Pos) const
+         {
+         return IsBigEndian ? (MIL_UINT32)((Data[Pos] << 8) | Data[Pos + 1]) : ReadLe16(Data + Pos);
+         }
+      MIL_UINT32 Read32(std::size_t Pos) const
+         {
+         return IsBigEndian ? (Read16(Pos) << 16) | Read16(Pos + 2) : ReadLe32(Data + Pos);
+         }
+      bool ReadField(std::size_t FieldPos, MIL_UINT32 ValueIndex, MIL_UINT32& Value) const
+         {
+         MIL_UINT32 Type  = Read16(FieldPos + 2);
+         MIL_UINT32 Count = Read32(FieldPos + 4);
+         std::size_t TypeSize = Type == 3 ? 2 : Type == 4 ? 4 : 0;
+         if(TypeSize == 0 || ValueIndex >= Count)
+            return false;
+         std::size_t ValuesPos = Count * TypeSize <= 4 ? FieldPos + 8 : Read32(FieldPos + 8);
+         std::size_t Pos = ValuesPos + ValueIndex * TypeSize;
+         if(Pos + TypeSize > Size)
+            return false;
+         Value = TypeSize == 2 ? Read16(Pos) : Read32(Pos);
+         return true;
+         }
+      };
+
+   bool ParseTiffImage(const MIL_UINT8* Data, std::size_t Size, SRasterImage& Raster)
+      {
+      STiffReader Reader = {Data, Size, Data[0] == 'M'};
+      std::size_t IfdPos = Reader.Read32(4);
+      if(IfdPos + 2 > Size)
+         return false;
+      MIL_UINT32 NbFields = Reader.Read16(IfdPos);
+      if(IfdPos + 2 + 12 * (std::size_t)NbFields > Size)
+         return false;
+
+      MIL_UINT32 SizeX = 0, SizeY = 0, BitsPerSample = 1, Compression = 1;
+      MIL_UINT32 SamplesPerPixel = 1, RowsPerStrip = 0xFFFFFFFF, PlanarConfig = 1;
+      std::size_t StripOffsetsField = 0, NbStrips = 0;
+      for(MIL_UINT32 i = 0; i < NbFields; i++)
+         {
+         std::size_t FieldPos = IfdPos + 2 + 12 * (std::size_t)i;
+         bool Success = true;
+         switch(Reader.Read16(FieldPos))
+            {
+            case 256: Success = Reader.ReadField(FieldPos, 0, SizeX);           break;
+            case 257: Success = Reader.ReadField(FieldPos, 0, SizeY);           break;
+            case 258: Success = Reader.ReadField(FieldPos, 0, BitsPerSample);   break;
+            case 259: Success = Reader.ReadField(FieldPos, 0, Compression);     break;
+            case 277: Success = Reader.ReadField(FieldPos, 0, SamplesPerPixel); break;
+            case 278: Success = Reader.ReadField(FieldPos, 0, RowsPerStrip);    break;
+            case 284: Success = Reader.ReadField(FieldPos, 0, PlanarConfig);    break;
+            case 273:
+               StripOffsetsField = FieldPos;
+               NbStrips = Reader.Read32(FieldPos + 4);
+               break;
+            default:
+               break;
+            }
+         if(!Success)
+            return false;
+         }
+
+      // Only uncompressed 8-bit gray, palette or RGB images, as written by MIL.
+      if(BitsPerSample != 8 || Compression != 1 || PlanarConfig != 1 ||
+         (SamplesPerPixel != 1 && SamplesPerPixel != 3) ||
+         SizeX == 0 || SizeY == 0 || StripOffsetsField == 0 || RowsPerStrip == 0)
+         return false;
+
+      std::size_t RowSize = (std::size_t)SizeX * SamplesPerPixel;
+      RowsPerStrip = std::min(RowsPerStrip, SizeY);
+      if(NbStrips < (SizeY + RowsPerStrip - 1) / RowsPerStrip)
+         return false;
+
+      Raster.SizeX = SizeX;
+      Raster.SizeY = SizeY;
+      Raster.SizeBand = SamplesPerPixel;
+      Raster.IsBgr = false;
+      Raster.Rows.resize(SizeY);
+      for(MIL_UINT32 Strip = 0; Strip * RowsPerStrip < SizeY; Strip++)
+         {
+         MIL_UINT32 StripOffset;
+         if(!Reader.ReadField(StripOffsetsField, Strip, StripOffset))
+            return false;
+         MIL_UINT32 FirstRow = Strip * RowsPerStrip;
+         MIL_UINT32 NbRows = std::min(RowsPerStrip, SizeY - FirstRow);
+         if((std::size_t)StripOffset + NbRows * RowSize > Size)
+            return false;
+         for(MIL_UINT32 Row = 0; Row < NbRows; Row++)
+            Raster.Rows[FirstRow + Row] = Data + StripOffset + Row * RowSize;
+         }
+      return true;
+      }
+
+   bool ParseBmpImage(const MIL_UINT8* Data, std::size_t Size, SRasterImage& Raster)
+      {
+      static const std::size_t FILE_HEADER_SIZE = 14;
+      if(Size < FILE_HEADER_SIZE + 40)
+         return false;
+
+      MIL_UINT32 PixelOffset = ReadLe32(Data + 10);
+      MIL_INT32 SizeX        = (MIL_INT32)ReadLe32(Data + 18);
+      MIL_INT32 SizeY        = (MIL_INT32)ReadLe32(Data + 22);
+      MIL_UINT16 BitCount    = ReadLe16(Data + 28);
+      MIL_UINT32 Compression = ReadLe32(Data + 30);
+
+      // Only uncompressed 8-bit (indexed or gray) and 24-bit images.
+      if(Compression != 0 || (BitCount != 8 && BitCount != 24) || SizeX <= 0 || SizeY == 0)
+         return false;
+
+      // The rows are stored bottom-up unless the height is negative, and are
+      // padded to 4 bytes.
+      bool IsTopDown = SizeY < 0;
+      MIL_INT Height = IsTopDown ? -(MIL_INT)SizeY : SizeY;
+      std::size_t RowStride = (((std::size_t)SizeX * BitCount + 31) / 32) * 4;
+      if((std::size_t)PixelOffset + Height * RowStride > Size)
+         return false;
+
+      Raster.SizeX = SizeX;
+      Raster.SizeY = Height;
+      Raster.SizeBand = BitCount == 8 ? 1 : 3;
+      Raster.IsBgr = true;
+      Raster.Rows.resize((std::size_t)Height);
+      for(MIL_INT Row = 0; Row < Height; Row++)
+         {
+         MIL_INT StoredRow = IsTopDown ? Row : Height - 1 - Row;
+         Raster.Rows[(std::size_t)Row] = Data + PixelOffset + StoredRow * RowStride;
+         }
+      return true;
+      }
+   }
+
+// Decodes the content of a TIFF or BMP file in place. The file extension is
+// not trusted: the example images are TIFF files named .bmp.
+bool ParseRasterImage(const MIL_UINT8* Data, std::size_t Size, SRasterImage& Raster)
+   {
+   if(Size < 8)
+      return false;
+   if((Data[0] == 'I' && Data[1] == 'I' && Data[2] == 42 && Data[3] == 0) ||
+      (Data[0] == 'M' && Data[1] == 'M' && Data[2] == 0 && Data[3] == 42))
+      return ParseTiffImage(Data, Size, Raster);
+   if(Data[0] == 'B' && Data[1] == 'M')
+      return ParseBmpImage(Data, Size, Raster);
+   return false;
+   }
+
+// Puts the rows of a raster, from FirstRow, into a buffer of the same width,
+// as many rows as the buffer holds, with a single put when they are contiguous.
+void PutRasterRows(const SRasterImage& Raster, MIL_INT FirstRow, MIL_ID Dest, std::vector<MIL_UINT8>& PackedRows)
+   {
+   MIL_INT NbRows = MbufInquire(Dest, M_SIZE_Y, M_NULL);
+   std::size_t RowSize = (std::size_t)(Raster.SizeX * Raster.SizeBand);
+   const MIL_UINT8* const* Rows = &Raster.Rows[(std::size_t)FirstRow];
+   const MIL_UINT8* Pixels = Rows[0];
+   for(MIL_INT Row = 1; Row < NbRows; Row++)
+      {
+      if(Rows[Row] != Rows[0] + Row * RowSize)
+         {
+         PackedRows.resize(RowSize * (std::size_t)NbRows);
+         for(MIL_INT i = 0; i < NbRows; i++)
+            std::copy(Rows[i], Rows[i] + RowSize, &PackedRows[(std::size_t)i * RowSize]);
+         Pixels = PackedRows.data();
+         break;
+         }
+      }
+
+   if(Raster.SizeBand == 1)
+      MbufPut2d(Dest, 0, 0, Raster.SizeX, NbRows, Pixels);
+   else
+      MbufPutColor2d(Dest, M_PACKED + (Raster.IsBgr ? M_BGR24 : M_RGB24), M_ALL_BANDS, 0, 0, Raster.SizeX, NbRows, Pixels);
+   }
+
+namespace
+   {
+   void DeinterleaveRowScalar(const MIL_UINT8* Packed, MIL_INT NbPixels, MIL_UINT8* Plane0, MIL_UINT8* Plane1, MIL_UINT8* Plane2)
+      {
+      for(MIL_INT x = 0; x < NbPixels; x++, Packed += 3)
+         {
+         Plane0[x] = Packed[0];
+         Plane1[x] = Packed[1];
+         Plane2[x] = Packed[2];
+         }
+      }
+
+#if defined(_M_IX86) || defined(_M_X64)
+   // Shuffle masks taking the bytes of one plane from each of the three
+   // vectors that hold 16 packed pixels; the other bytes are zeroed (0x80).
+   struct SDeinterleaveMasks
+      {
+      __m128i Masks[3][3];   // [Plane][Vector]
+
+      SDeinterleaveMasks()
+         {
+         for(int Plane = 0; Plane < 3; Plane++)
+            {
+            for(int Vector = 0; Vector < 3; Vector++)
+               {
+               MIL_UINT8 Mask[16];
+               for(int x = 0; x < 16; x++)
+                  {
+                  int Byte = 3 * x + Plane - 16 * Vector;
+                  Mask[x] = (MIL_UINT8)(Byte >= 0 && Byte < 16 ? Byte : 0x80);
+                  }
+               Masks[Plane][Vector] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Mask));
+               }
+            }
+         }
+      };
+   const SDeinterleaveMasks DeinterleaveShuffles;
+
+   // Splits 16 packed pixels. Only called once the processor is known to support SSSE3.
+   inline void Deinterleave16Ssse3(const MIL_UINT8* Packed, MIL_UINT8* Plane0, MIL_UINT8* Plane1, MIL_UINT8* Plane2)
+      {
+      MIL_UINT8* Planes[3] = {Plane0, Plane1, Plane2};
+      __m128i Vectors[3];
+      for(int Vector = 0; Vector < 3; Vector++)
+         Vectors[Vector] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Packed) + Vector);
+      for(int Plane = 0; Plane < 3; Plane++)
+         {
+         const __m128i* Masks = DeinterleaveShuffles.Masks[Plane];
+         __m128i Bytes = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(Vectors[0], Masks[0]),
+                                                   _mm_shuffle_epi8(Vectors[1], Masks[1])),
+                                      _mm_shuffle_epi8(Vectors[2], Masks[2]));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(Planes[Plane]), Bytes);
+         }
+      }
+
+   void DeinterleaveRowSsse3(const MIL_UINT8* Packed, MIL_INT NbPixels, MIL_UINT8* Plane0, MIL_UINT8* Plane1, MIL_UINT8* Plane2)
+      {
+      MIL_INT x = 0;
+      for(; x + 16 <= NbPixels; x += 16)
+         Deinterleave16Ssse3(Packed + 3 * x, Plane0 + x, Plane1 + x, Plane2 + x);
+      DeinterleaveRowScalar(Packed + 3 * x, NbPixels - x, Plane0 + x, Plane1 + x, Plane2 + x);
+      }
+
+   // The row width is a template parameter, so that the loop has a fixed trip
+   // count and is unrolled. The last, partial, group of 16 pixels is split
+   // again from the end of the row, overlapping the previous group, instead
+   // of going scalar.
+   template<MIL_INT NB_PIXELS>
+   void DeinterleaveFixedRowSsse3(const MIL_UINT8* Packed, MIL_INT, MIL_UINT8* Plane0, MIL_UINT8* Plane1, MIL_UINT8* Plane2)
+      {
+      static_assert(NB_PIXELS >= 16, "The fixed rows hold at least 16 pixels.");
+      for(MIL_INT x = 0; x + 16 <= NB_PIXELS; x += 16)
+         Deinterleave16Ssse3(Packed + 3 * x, Plane0 + x, Plane1 + x, Plane2 + x);
+      if(NB_PIXELS % 16 != 0)
+         {
+         const MIL_INT x = NB_PIXELS - 16;
+         Deinterleave16Ssse3(Packed + 3 * x, Plane0 + x, Plane1 + x, Plane2 + x);
+         }
+      }
+
+   bool IsSsse3Supported()
+      {
+      int Info[4];
+      __cpuid(Info, 1);
+      const int SSSE3 = 1 << 9;
+      return (Info[2] & SSSE3) != 0;
+      }
+#endif
+   }
+
+DeinterleaveRowFunction SelectDeinterleaveRow(MIL_INT NbPixels)
+   {
+#if defined(_M_IX86) || defined(_M_X64)
+   static const bool HasSsse3 = IsSsse3Supported();
+   if(!HasSsse3)
+      return DeinterleaveRowScalar;
+   switch(NbPixels)
+      {
+      case NO_AUG_IMAGE_SIZE: return DeinterleaveFixedRowSsse3<NO_AUG_IMAGE_SIZE>;
+      case TILE_IMAGE_SIZE:   return DeinterleaveFixedRowSsse3<TILE_IMAGE_SIZE>;
+      default:                return DeinterleaveRowSsse3;
+      }
+#else
+   return DeinterleaveRowScalar;
+#endif
+   }
+
+void CopyRasterTile(const SRasterImage& Raster, MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY,
+                    DeinterleaveRowFunction DeinterleaveRow, std::vector<MIL_UINT8>& Planes)
+   {
+   std::size_t PlaneSize = (std::size_t)(SizeX * SizeY);
+   Planes.resize(PlaneSize * (std::size_t)Raster.SizeBand);
+   const std::size_t RowSize = (std::size_t)(SizeX * Raster.SizeBand);
+   const std::size_t RowOffset = (std::size_t)(OffsetX * Raster.SizeBand);
+   for(MIL_INT y = 0; y < SizeY; y++)
+      {
+      const MIL_UINT8* Src = Raster.Rows[(std::size_t)(OffsetY + y)] + RowOffset;
+
+      // The rows of a bottom-up BMP go backward in memory, which defeats the
+      // hardware prefetcher: the next row is requested while this one is split.
+#if defined(_M_IX86) || defined(_M_X64)
+      if(y + 1 < SizeY)
+         {
+         const char* Next = reinterpret_cast<const char*>(Raster.Rows[(std::size_t)(OffsetY + y + 1)] + RowOffset);
+         for(std::size_t Line = 0; Line < RowSize; Line += 64)
+            _mm_prefetch(Next + Line, _MM_HINT_T0);
+         }
+#endif
+
+      MIL_UINT8* Dst = &Planes[(std::size_t)(y * SizeX)];
+      if(Raster.SizeBand == 1)
+         std::copy(Src, Src + RowSize, Dst);
+      else if(Raster.IsBgr)
+         DeinterleaveRow(Src, SizeX, Dst + 2 * PlaneSize, Dst + PlaneSize, Dst);
+      else
+         DeinterleaveRow(Src, SizeX, Dst, Dst + PlaneSize, Dst + 2 * PlaneSize);
+      }
+   }
+
+bool CImageBandReader::Open(MIL_ID MilSystem, const MIL_STRING& FileName, bool MapFile)
+   {
+   m_System = MilSystem;
+   m_Band.reset();
+   m_Image.reset();
+   m_File.Close();
+   m_Raster = SRasterImage();
+
+   if(MapFile && m_File.Open(FileName) && ParseRasterImage(m_File.Data(), m_File.Size(), m_Raster))
+      {
+      m_SizeX = m_Raster.SizeX;
+      m_SizeY = m_Raster.SizeY;
+      m_SizeBand = m_Raster.SizeBand;
+      return true;
+      }
+
+   // Not mapped, or compressed: MIL restores the whole image.
+   m_File.Close();
+   m_Raster = SRasterImage();
+   m_Image = MbufRestore(FileName, MilSystem, M_UNIQUE_ID);
+   if(!m_Image)
+      return false;
+   m_SizeX = MbufInquire(m_Image, M_SIZE_X, M_NULL);
+   m_SizeY = MbufInquire(m_Image, M_SIZE_Y, M_NULL);
+   m_SizeBand = MbufInquire(m_Image, M_SIZE_BAND, M_NULL);
+
+   // The bands were requested but the whole image is in memory.
+   if(MapFile)
+      MosPrintf(MIL_TEXT("\nWarning: %s is not an uncompressed TIFF or BMP file and is restored whole, not in bands.\n"), FileName.c_str());
+   return true;
+   }
+
+bool CImageBandReader::Open(MIL_ID MilSystem, const MIL_UINT8* Data, std::size_t Size)
+   {
+   m_System = MilSystem;
+   m_Band.reset();
+   m_Image.reset();
+   m_File.Close();
+   m_Raster = SRasterImage();
+   if(!ParseRasterImage(Data, Size, m_Raster))
+      return false;
+
+   m_SizeX = m_Raster.SizeX;
+   m_SizeY = m_Raster.SizeY;
+   m_SizeBand = m_Raster.SizeBand;
+   return true;
+   }
+
+MIL_ID CImageBandReader::ReadBand(MIL_INT OffsetY, MIL_INT NbRows)
+   {
+   m_Band.reset();
+   if(m_Image)
+      {
+      m_Band = MbufChild2d(m_Image, 0, OffsetY, m_SizeX, NbRows, M_UNIQUE_ID);
+      return m_Band;
+      }
+
+   // The band buffer is reused as long as it is high enough.
+   if(!m_BandBuffer ||
+      MbufInquire(m_BandBuffer, M_SIZE_X, M_NULL) != m_SizeX ||
+      MbufInquire(m_BandBuffer, M_SIZE_Y, M_NULL) < NbRows ||
+      MbufInquire(m_BandBuffer, M_SIZE_BAND, M_NULL) != m_SizeBand)
+      {
+      m_BandBuffer = MbufAllocColor(m_System, m_SizeBand, m_SizeX, NbRows, 8 + M_UNSIGNED, M_IMAGE + M_PROC, M_UNIQUE_ID);
+      }
+   m_Band = MbufChild2d(m_BandBuffer, 0, 0, m_SizeX, NbRows, M_UNIQUE_ID);
+   PutRasterRows(m_Raster, OffsetY, m_Band, m_PackedRows);
+   return m_Band;
+   }
+
+void CImageBandReader::CopyTile(MIL_INT OffsetX, MIL_INT OffsetY, MIL_ID Tile)
+   {
+   MIL_INT TileSizeX = MbufInquire(Tile, M_SIZE_X, M_NULL);
+   MIL_INT TileSizeY = MbufInquire(Tile, M_SIZE_Y, M_NULL);
+   // The tiles of a stage all have the same width: the kernel is only
+   // selected again when it changes.
+   if(TileSizeX != m_TileSizeX)
+      {
+      m_DeinterleaveRow = SelectDeinterleaveRow(TileSizeX);
+      m_TileSizeX = TileSizeX;
+      }
+   CopyRasterTile(m_Raster, OffsetX, OffsetY, TileSizeX, TileSizeY, m_DeinterleaveRow, m_TilePlanes);
+   if(m_SizeBand == 1)
+      MbufPut2d(Tile, 0, 0, TileSizeX, TileSizeY, m_TilePlanes.data());
+   else
+      MbufPutColor2d(Tile, M_PLANAR, M_ALL_BANDS, 0, 0, TileSizeX, TileSizeY, m_TilePlanes.data());
+   }
@@ -0,0 +1,91 @@
+﻿//*************************************************************************************
+//
+// File name: RasterImage.h
+//
+// Synopsis:  Uncompressed TIFF and BMP images decoded in place, the SIMD kernels that
+//            cut them into tiles, and the band by band reader of the source and label
+//            images.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include "Utilities.h"
+
+// Uncompressed image decoded in place from the content of a baseline TIFF or
+// BMP file: the rows point into the file data, that must outlive the raster.
+struct SRasterImage
+   {
+   MIL_INT SizeX    = 0;
+   MIL_INT SizeY    = 0;
+   MIL_INT SizeBand = 0;
+   bool    IsBgr    = false; // The color bands are stored in BGR order.
+   std::vector<const MIL_UINT8*> Rows;
+   };
+
+// Splits a row of packed 3-byte pixels into three planes, in the byte order
+// of the pixels.
+typedef void (*DeinterleaveRowFunction)(const MIL_UINT8* Packed, MIL_INT NbPixels, MIL_UINT8* Plane0, MIL_UINT8* Plane1, MIL_UINT8* Plane2);
+
+// Kernel splitting the rows of NbPixels pixels. Only the default tile widths,
+// NO_AUG_IMAGE_SIZE and TILE_IMAGE_SIZE, have a kernel unrolled for their
+// width, and only with SSSE3; the other widths, set in the config file or with
+// --NoAugImageSize/--TileImageSize, use the generic kernel.
+DeinterleaveRowFunction SelectDeinterleaveRow(MIL_INT NbPixels);
+
+// Source image, or label image, read band by band. A mapped uncompressed
+// TIFF or BMP file, or the content of an archive entry, is only copied into a
+// MIL buffer one band at a time; the other images are restored whole by MIL
+// and the bands are child buffers.
+class CImageBandReader
+   {
+   public:
+      // With MapFile, an uncompressed TIFF or BMP file is mapped rather than restored.
+      bool Open(MIL_ID MilSystem, const MIL_STRING& FileName, bool MapFile);
+
+      // Reads an image file held in memory, that must outlive the reader.
+      bool Open(MIL_ID MilSystem, const MIL_UINT8* Data, std::size_t Size);
+
+      MIL_INT SizeX() const    { return m_SizeX; }
+      MIL_INT SizeY() const    { return m_SizeY; }
+      MIL_INT SizeBand() const { return m_SizeBand; }
+
+      // Returns the rows [OffsetY, OffsetY + NbRows) of the image, in a buffer
+      // that is valid until the next call.
+      MIL_ID ReadBand(MIL_INT OffsetY, MIL_INT NbRows);
+
+      // A mapped image can also be cut into tiles straight from its rows,
+      // without reading the band that holds them.
+      bool IsMapped() const { return !m_Raster.Rows.empty(); }
+      void CopyTile(MIL_INT OffsetX, MIL_INT OffsetY, MIL_ID Tile);
+
+      // Packed pixels of a row of a mapped image, top row first whatever the
+      // order of the rows in the file; they stay valid while the image is open.
+      const MIL_UINT8* Row(MIL_INT y) const { return m_Raster.Rows[(std::size_t)y]; }
+
+   private:
+      MIL_ID                 m_System = M_NULL;
+      MIL_INT                m_SizeX = 0;
+      MIL_INT                m_SizeY = 0;
+      MIL_INT                m_SizeBand = 0;
+      CMappedFile            m_File;
+      SRasterImage           m_Raster;
+      MIL_UNIQUE_BUF_ID      m_Image;        // The whole image, when restored by MIL.
+      MIL_UNIQUE_BUF_ID      m_BandBuffer;
+      MIL_UNIQUE_BUF_ID      m_Band;
+      std::vector<MIL_UINT8> m_PackedRows;
+      std::vector<MIL_UINT8> m_TilePlanes;
+      MIL_INT                m_TileSizeX = 0;         // Width for which m_DeinterleaveRow was selected.
+      DeinterleaveRowFunction m_DeinterleaveRow = nullptr;
+   };
+
+bool ParseRasterImage(const MIL_UINT8* Data, std::size_t Size, SRasterImage& Raster);
+
+void PutRasterRows(const SRasterImage& Raster, MIL_INT FirstRow, MIL_ID Dest, std::vector<MIL_UINT8>& PackedRows);
+
+// Copies a region of a raster into one plane per band, in the band order of
+// MIL (red first), as MbufPutColor2d expects M_PLANAR data. The rows are split
+// by DeinterleaveRow, selected once for the tile width by SelectDeinterleaveRow.
+void CopyRasterTile(const SRasterImage& Raster, MIL_INT OffsetX, MIL_INT OffsetY, MIL_INT SizeX, MIL_INT SizeY,
+                    DeinterleaveRowFunction DeinterleaveRow, std::vector<MIL_UINT8>& Planes);
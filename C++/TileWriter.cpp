@@ -0,0 +1,237 @@
+﻿//*************************************************************************************
+//
+// File name: TileWriter.cpp
+//
+// Synopsis:  Saving of the tiles in the output encoding, on worker threads, with a
+//            direct BMP writer.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "TileWriter.h"
+#include <algorithm>
+
+CTileWriter::CTileWriter(MIL_ID System, const MIL_STRING& Encoding, MIL_INT NbThreads)
+   : m_System(System),
+     m_FileFormat(M_NULL),
+     m_MaxQueued(4 * (std::size_t)NbThreads)
+   {
+   if(Encoding == MIL_TEXT("png"))
+      {
+      m_FileFormat = M_PNG;
+      m_Extension = MIL_TEXT(".png");
+      }
+   else if(Encoding == MIL_TEXT("bmp"))
+      {
+      m_FileFormat = M_BMP;
+      m_Extension = MIL_TEXT(".bmp");
+      }
+
+   // A buffer is either queued, being written, in the hands of Save or free.
+   m_Queue.resize(m_MaxQueued);
+   m_FreeBuffers.reserve(m_MaxQueued + (std::size_t)NbThreads + 1);
+
+   for(MIL_INT i = 0; i < NbThreads; i++)
+      m_Threads.emplace_back(&CTileWriter::WorkerLoop, this);
+   }
+
+CTileWriter::~CTileWriter()
+   {
+   Flush();
+      {
+      std::lock_guard<std::mutex> Lock(m_Mutex);
+      m_Stop = true;
+      }
+   m_JobQueued.notify_all();
+   for(auto& Thread : m_Threads)
+      Thread.join();
+   }
+
+void CTileWriter::Save(MIL_ID Image, const MIL_STRING& FileName)
+   {
+   if(m_Threads.empty())
+      {
+      if(!WriteImage(Image, FileName, m_FileBuffer, false) && m_NbFailed++ == 0)
+         m_FirstFailedFile = FileName;
+      return;
+      }
+
+   SPooledImage Buffer = AcquireBuffer(Image);
+   Buffer.FileName.assign(FileName);
+   MbufCopy(Image, Buffer.Image);
+
+      {
+      std::unique_lock<std::mutex> Lock(m_Mutex);
+      m_JobDone.wait(Lock, [this] { return m_QueueSize < m_MaxQueued; });
+      m_Queue[(m_QueueHead + m_QueueSize) % m_MaxQueued] = std::move(Buffer);
+      m_QueueSize++;
+      }
+   m_JobQueued.notify_one();
+   }
+
+bool CTileWriter::Flush()
+   {
+   std::unique_lock<std::mutex> Lock(m_Mutex);
+   m_JobDone.wait(Lock, [this] { return m_QueueSize == 0 && m_NbWriting == 0; });
+
+   // The failures are reported here, from the calling thread, rather than by
+   // the workers, since their entries are already in the tables.
+   if(m_NbFailed == 0)
+      return true;
+   MosPrintf(MIL_TEXT("\n%d tile(s) could not be written, starting with %s.\n"), (int)m_NbFailed, m_FirstFailedFile.c_str());
+   m_NbFailed = 0;
+   m_FirstFailedFile.clear();
+   return false;
+   }
+
+// Returns false if the file could not be written. The errors of MbufSave and
+// MbufExport are read back with MappGetError, from the error of the calling
+// thread when it is a worker.
+bool CTileWriter::WriteImage(MIL_ID Image, const MIL_STRING& FileName, SFileBuffer& FileBuffer, bool IsWorker) const
+   {
+   if(m_FileFormat == M_BMP)
+      return WriteBmpFile(Image, FileName, FileBuffer);
+
+   if(m_FileFormat == M_NULL)
+      MbufSave(FileName, Image);
+   else
+      MbufExport(FileName, m_FileFormat, Image);
+   return MappGetError(M_DEFAULT, IsWorker ? M_THREAD_CURRENT : M_CURRENT, M_NULL) == M_NULL_ERROR;
+   }
+
+namespace
+   {
+   void PutLe16(MIL_UINT8* Data, MIL_UINT16 Value)
+      {
+      Data[0] = (MIL_UINT8)Value;
+      Data[1] = (MIL_UINT8)(Value >> 8);
+      }
+
+   void PutLe32(MIL_UINT8* Data, MIL_UINT32 Value)
+      {
+      PutLe16(Data, (MIL_UINT16)Value);
+      PutLe16(Data + 2, (MIL_UINT16)(Value >> 16));
+      }
+   }
+
+// Writes a 24-bit BMP file, or an 8-bit one with a gray palette, in a single
+// WriteFile: the header and the pixels are assembled in one buffer.
+bool CTileWriter::WriteBmpFile(MIL_ID Image, const MIL_STRING& FileName, SFileBuffer& FileBuffer)
+   {
+   static const std::size_t HEADERS_SIZE = 14 + 40;
+   static const std::size_t PALETTE_SIZE = 256 * 4;
+
+   MIL_INT SizeX = MbufInquire(Image, M_SIZE_X, M_NULL);
+   MIL_INT SizeY = MbufInquire(Image, M_SIZE_Y, M_NULL);
+   MIL_INT SizeBand = MbufInquire(Image, M_SIZE_BAND, M_NULL);
+   std::size_t RowSize = (std::size_t)(SizeX * (SizeBand == 1 ? 1 : 3));
+   std::size_t RowStride = (RowSize + 3) & ~(std::size_t)3;
+   std::size_t PixelOffset = HEADERS_SIZE + (SizeBand == 1 ? PALETTE_SIZE : 0);
+
+   if(FileBuffer.SizeX != SizeX || FileBuffer.SizeY != SizeY || FileBuffer.SizeBand != SizeBand)
+      {
+      FileBuffer.Data.assign(PixelOffset + RowStride * (std::size_t)SizeY, 0);
+      MIL_UINT8* Header = FileBuffer.Data.data();
+      Header[0] = 'B';
+      Header[1] = 'M';
+      PutLe32(Header + 2, (MIL_UINT32)FileBuffer.Data.size());
+      PutLe32(Header + 10, (MIL_UINT32)PixelOffset);
+      PutLe32(Header + 14, 40);
+      PutLe32(Header + 18, (MIL_UINT32)SizeX);
+      PutLe32(Header + 22, (MIL_UINT32)SizeY);
+      PutLe16(Header + 26, 1);
+      PutLe16(Header + 28, SizeBand == 1 ? 8 : 24);
+      PutLe32(Header + 34, (MIL_UINT32)(RowStride * (std::size_t)SizeY));
+      if(SizeBand == 1)
+         {
+         PutLe32(Header + 46, 256);
+         for(MIL_UINT32 i = 0; i < 256; i++)
+            PutLe32(Header + HEADERS_SIZE + 4 * i, i * 0x010101);
+         }
+      FileBuffer.SizeX = SizeX;
+      FileBuffer.SizeY = SizeY;
+      FileBuffer.SizeBand = SizeBand;
+      }
+
+   // MIL gives the rows top-down and packed; the file stores them bottom-up,
+   // padded to 4 bytes with the zeros left by the header setup.
+   FileBuffer.Pixels.resize(RowSize * (std::size_t)SizeY);
+   if(SizeBand == 1)
+      MbufGet2d(Image, 0, 0, SizeX, SizeY, FileBuffer.Pixels.data());
+   else
+      MbufGetColor(Image, M_PACKED + M_BGR24, M_ALL_BANDS, FileBuffer.Pixels.data());
+   for(MIL_INT y = 0; y < SizeY; y++)
+      {
+      const MIL_UINT8* Row = &FileBuffer.Pixels[(std::size_t)y * RowSize];
+      std::copy(Row, Row + RowSize, &FileBuffer.Data[PixelOffset + (std::size_t)(SizeY - 1 - y) * RowStride]);
+      }
+
+   HANDLE File = CreateFile(FileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if(File == INVALID_HANDLE_VALUE)
+      return false;
+   DWORD Written = 0;
+   BOOL Success = WriteFile(File, FileBuffer.Data.data(), (DWORD)FileBuffer.Data.size(), &Written, NULL) && Written == (DWORD)FileBuffer.Data.size();
+   CloseHandle(File);
+   return Success != FALSE;
+   }
+
+// Returns a free buffer of the format of the image, or a new one. The tiles
+// of a run only have a few formats, so the pool does not grow past the
+// number of tiles in flight.
+CTileWriter::SPooledImage CTileWriter::AcquireBuffer(MIL_ID Image)
+   {
+   MIL_INT SizeX = MbufInquire(Image, M_SIZE_X, M_NULL);
+   MIL_INT SizeY = MbufInquire(Image, M_SIZE_Y, M_NULL);
+   MIL_INT SizeBand = MbufInquire(Image, M_SIZE_BAND, M_NULL);
+      {
+      std::lock_guard<std::mutex> Lock(m_Mutex);
+      for(std::size_t i = 0; i < m_FreeBuffers.size(); i++)
+         {
+         const SPooledImage& Free = m_FreeBuffers[i];
+         if(Free.SizeX == SizeX && Free.SizeY == SizeY && Free.SizeBand == SizeBand)
+            {
+            SPooledImage Buffer = std::move(m_FreeBuffers[i]);
+            m_FreeBuffers.erase(m_FreeBuffers.begin() + i);
+            return Buffer;
+            }
+         }
+      }
+
+   SPooledImage Buffer;
+   Buffer.Image = MbufClone(Image, m_System, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_DEFAULT, M_UNIQUE_ID);
+   Buffer.SizeX = SizeX;
+   Buffer.SizeY = SizeY;
+   Buffer.SizeBand = SizeBand;
+   Buffer.FileName.reserve(FILE_NAME_RESERVE);
+   return Buffer;
+   }
+
+void CTileWriter::WorkerLoop()
+   {
+   SFileBuffer FileBuffer;
+   for(;;)
+      {
+      SPooledImage Buffer;
+         {
+         std::unique_lock<std::mutex> Lock(m_Mutex);
+         m_JobQueued.wait(Lock, [this] { return m_Stop || m_QueueSize > 0; });
+         if(m_QueueSize == 0)
+            return;
+         Buffer = std::move(m_Queue[m_QueueHead]);
+         m_QueueHead = (m_QueueHead + 1) % m_MaxQueued;
+         m_QueueSize--;
+         m_NbWriting++;
+         }
+
+      bool IsWritten = WriteImage(Buffer.Image, Buffer.FileName, FileBuffer, true);
+
+         {
+         std::lock_guard<std::mutex> Lock(m_Mutex);
+         if(!IsWritten && m_NbFailed++ == 0)
+            m_FirstFailedFile = Buffer.FileName;
+         m_FreeBuffers.push_back(std::move(Buffer));
+         m_NbWriting--;
+         }
+      m_JobDone.notify_all();
+      }
+   }
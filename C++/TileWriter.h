@@ -0,0 +1,91 @@
+﻿//*************************************************************************************
+//
+// File name: TileWriter.h
+//
+// Synopsis:  Saving of the tiles in the output encoding, on worker threads, with a
+//            direct BMP writer.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+// Keep windows.h from defining the min and max macros, that break std::min and std::max.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <mil.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Saves the tiles in the output encoding. With worker threads, the tile is
+// copied into a buffer of a pool and the caller can reuse its own buffer right
+// away, while the encoding and the write of the file overlap the extraction.
+// The number of queued tiles is bounded, so the pool stays small, and the
+// queue is a ring of pooled buffers that each keep their own path string, so
+// queuing a tile does not allocate once the pool is built.
+class CTileWriter
+   {
+   public:
+      CTileWriter(MIL_ID System, const MIL_STRING& Encoding, MIL_INT NbThreads);
+      ~CTileWriter();
+
+      // Extension of the saved tiles, or an empty string to keep the one of the sources.
+      const MIL_STRING& Extension() const { return m_Extension; }
+
+      void Save(MIL_ID Image, const MIL_STRING& FileName);
+
+      // Waits until all the queued tiles are written, before they are read
+      // back. Returns false, after reporting them, if tiles could not be
+      // written since the previous call.
+      bool Flush();
+
+   private:
+      struct SPooledImage
+         {
+         MIL_UNIQUE_BUF_ID Image;
+         MIL_INT           SizeX;
+         MIL_INT           SizeY;
+         MIL_INT           SizeBand;
+         MIL_STRING        FileName; // Path of the queued tile, reusing its storage.
+         };
+      static const std::size_t FILE_NAME_RESERVE = 512;
+
+      // Content of a BMP file, reused from one tile to the next by the same
+      // thread. The header only depends on the size of the tiles, so it is
+      // only written again when the size changes.
+      struct SFileBuffer
+         {
+         MIL_INT                SizeX = 0;
+         MIL_INT                SizeY = 0;
+         MIL_INT                SizeBand = 0;
+         std::vector<MIL_UINT8> Data;
+         std::vector<MIL_UINT8> Pixels;
+         };
+
+      bool WriteImage(MIL_ID Image, const MIL_STRING& FileName, SFileBuffer& FileBuffer, bool IsWorker) const;
+      static bool WriteBmpFile(MIL_ID Image, const MIL_STRING& FileName, SFileBuffer& FileBuffer);
+      SPooledImage AcquireBuffer(MIL_ID Image);
+      void WorkerLoop();
+
+      MIL_ID                    m_System;
+      MIL_INT                   m_FileFormat;
+      MIL_STRING                m_Extension;
+      std::size_t               m_MaxQueued;
+      std::vector<std::thread>  m_Threads;
+      std::mutex                m_Mutex;
+      std::condition_variable   m_JobQueued;
+      std::condition_variable   m_JobDone;
+      std::vector<SPooledImage> m_Queue;            // Ring of m_MaxQueued queued tiles.
+      std::size_t               m_QueueHead = 0;
+      std::size_t               m_QueueSize = 0;
+      std::vector<SPooledImage> m_FreeBuffers;
+      SFileBuffer               m_FileBuffer;       // Without worker threads.
+      MIL_INT                   m_NbWriting = 0;
+      MIL_INT                   m_NbFailed = 0;
+      MIL_STRING                m_FirstFailedFile;
+      bool                      m_Stop = false;
+   };
@@ -0,0 +1,167 @@
+﻿//*************************************************************************************
+//
+// File name: Utilities.cpp
+//
+// Synopsis:  Helpers shared by the files of the example: stable hashes, little-endian
+//            reads, files mapped in memory and directory listings.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "Utilities.h"
+#include "DataPrepConfig.h"
+
+// FNV-1a hash of a string, used wherever a decision must be stable across
+// processes and runs. The strings are hashed as the bytes of their characters,
+// so that all the hashes (split, shards, fan-out, label cache) share HashBytes.
+MIL_UINT64 HashString(const MIL_STRING& Str, MIL_UINT64 Seed)
+   {
+   return HashChars(Str.c_str(), Str.size(), Seed);
+   }
+
+MIL_UINT64 HashChars(const MIL_TEXT_CHAR* Str, std::size_t Length, MIL_UINT64 Seed)
+   {
+   return HashBytes(reinterpret_cast<const MIL_UINT8*>(Str), Length * sizeof(MIL_TEXT_CHAR), Seed);
+   }
+
+MIL_UINT64 HashBytes(const MIL_UINT8* Data, std::size_t Size, MIL_UINT64 Seed)
+   {
+   MIL_UINT64 Hash = 14695981039346656037ULL ^ (Seed * 1099511628211ULL);
+   for(std::size_t i = 0; i < Size; i++)
+      {
+      Hash ^= (MIL_UINT64)Data[i];
+      Hash *= 1099511628211ULL;
+      }
+   return Hash;
+   }
+
+// Final mix of MurmurHash3, so that all the bits of a FNV-1a hash depend on
+// all the characters of the name.
+MIL_UINT64 MixHash(MIL_UINT64 Hash)
+   {
+   Hash ^= Hash >> 33;
+   Hash *= 0xFF51AFD7ED558CCDULL;
+   Hash ^= Hash >> 33;
+   Hash *= 0xC4CEB9FE1A85EC53ULL;
+   Hash ^= Hash >> 33;
+   return Hash;
+   }
+
+void CDirectoryListing::Scan(const MIL_STRING& FolderName, const MIL_STRING& Extension, bool Recursive)
+   {
+   m_FolderName = FolderName;
+   m_Chars.clear();
+   m_Offsets.clear();
+   m_SubFolders.clear();
+
+   MIL_STRING LowerExtension = ToLowerString(Extension);
+   std::vector<MIL_STRING> PendingFolders(1); // Relative to FolderName.
+   while(!PendingFolders.empty())
+      {
+      MIL_STRING SubFolder = std::move(PendingFolders.back());
+      PendingFolders.pop_back();
+
+      WIN32_FIND_DATA FindData;
+      HANDLE FindHandle = FindFirstFileEx((FolderName + SubFolder + MIL_TEXT("*")).c_str(), FindExInfoBasic, &FindData,
+                                          FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+      if(FindHandle == INVALID_HANDLE_VALUE)
+         continue;
+      do
+         {
+         const MIL_TEXT_CHAR* Name = FindData.cFileName;
+         std::size_t NameLength = std::char_traits<MIL_TEXT_CHAR>::length(Name);
+         if(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+            bool IsDotFolder = Name[0] == MIL_TEXT('.') && (NameLength == 1 || (NameLength == 2 && Name[1] == MIL_TEXT('.')));
+            if(Recursive && !IsDotFolder)
+               {
+               m_SubFolders.push_back(SubFolder + Name + MIL_TEXT("\\"));
+               PendingFolders.push_back(m_SubFolders.back());
+               }
+            continue;
+            }
+
+         // Compare the extension without building a string.
+         if(NameLength <= LowerExtension.size())
+            continue;
+         const MIL_TEXT_CHAR* NameExtension = Name + NameLength - LowerExtension.size();
+         bool IsMatch = true;
+         for(std::size_t i = 0; i < LowerExtension.size() && IsMatch; i++)
+            {
+            MIL_TEXT_CHAR Char = NameExtension[i];
+            if(Char >= MIL_TEXT('A') && Char <= MIL_TEXT('Z'))
+               Char = Char - MIL_TEXT('A') + MIL_TEXT('a');
+            IsMatch = Char == LowerExtension[i];
+            }
+         if(!IsMatch)
+            continue;
+
+         m_Offsets.push_back(m_Chars.size());
+         m_Chars.insert(m_Chars.end(), SubFolder.begin(), SubFolder.end());
+         m_Chars.insert(m_Chars.end(), Name, Name + NameLength + 1);
+         } while(FindNextFile(FindHandle, &FindData));
+      FindClose(FindHandle);
+      }
+   }
+
+bool CMappedFile::Open(const MIL_STRING& FileName)
+   {
+   Close();
+
+   m_File = CreateFile(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+   if(m_File == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER FileSize;
+   if(!GetFileSizeEx(m_File, &FileSize) || FileSize.QuadPart == 0)
+      {
+      Close();
+      return false;
+      }
+
+   m_Mapping = CreateFileMapping(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+   if(m_Mapping != NULL)
+      m_Data = (const MIL_UINT8*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+   if(m_Data == nullptr)
+      {
+      Close();
+      return false;
+      }
+   m_Size = (std::size_t)FileSize.QuadPart;
+   return true;
+   }
+
+void CMappedFile::Close()
+   {
+   if(m_Data != nullptr)
+      UnmapViewOfFile(m_Data);
+   if(m_Mapping != NULL)
+      CloseHandle(m_Mapping);
+   if(m_File != INVALID_HANDLE_VALUE)
+      CloseHandle(m_File);
+   m_File = INVALID_HANDLE_VALUE;
+   m_Mapping = NULL;
+   m_Data = nullptr;
+   m_Size = 0;
+   }
+
+// Hashes the path, the size and the last write time of a file. The content
+// is not read: a label file that is rewritten gets a new write time, so its
+// cached index is simply not found and is rebuilt.
+bool HashFileStamp(const MIL_STRING& FileName, MIL_UINT64& Hash)
+   {
+   WIN32_FILE_ATTRIBUTE_DATA Attributes;
+   if(!GetFileAttributesEx(FileName.c_str(), GetFileExInfoStandard, &Attributes))
+      return false;
+
+   MIL_UINT8 Stamp[16];
+   MIL_UINT64 Size = ((MIL_UINT64)Attributes.nFileSizeHigh << 32) | Attributes.nFileSizeLow;
+   MIL_UINT64 Time = ((MIL_UINT64)Attributes.ftLastWriteTime.dwHighDateTime << 32) | Attributes.ftLastWriteTime.dwLowDateTime;
+   for(int i = 0; i < 8; i++)
+      {
+      Stamp[i]     = (MIL_UINT8)(Size >> (8 * i));
+      Stamp[8 + i] = (MIL_UINT8)(Time >> (8 * i));
+      }
+   Hash = HashBytes(Stamp, sizeof(Stamp), HashString(FileName, 0));
+   return true;
+   }
@@ -0,0 +1,81 @@
+﻿//*************************************************************************************
+//
+// File name: Utilities.h
+//
+// Synopsis:  Helpers shared by the files of the example: stable hashes, little-endian
+//            reads, files mapped in memory and directory listings.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+// Keep windows.h from defining the min and max macros, that break std::min and std::max.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <mil.h>
+#include <vector>
+
+// Read-only view of a whole file mapped in memory.
+class CMappedFile
+   {
+   public:
+      CMappedFile() {}
+      ~CMappedFile() { Close(); }
+      CMappedFile(const CMappedFile&) = delete;
+      CMappedFile& operator=(const CMappedFile&) = delete;
+
+      bool Open(const MIL_STRING& FileName);
+      void Close();
+
+      const MIL_UINT8* Data() const { return m_Data; }
+      std::size_t Size() const      { return m_Size; }
+
+   private:
+      HANDLE           m_File    = INVALID_HANDLE_VALUE;
+      HANDLE           m_Mapping = NULL;
+      const MIL_UINT8* m_Data    = nullptr;
+      std::size_t      m_Size    = 0;
+   };
+
+// Names of the files of a folder, read with a single pass over the directory
+// and held contiguously, so that listing and deleting millions of files does
+// not allocate one string per file.
+class CDirectoryListing
+   {
+   public:
+      // Lists the files with the given extension (case insensitive, all the
+      // files if empty), optionally in the subfolders too. The names are
+      // relative to the folder.
+      void Scan(const MIL_STRING& FolderName, const MIL_STRING& Extension, bool Recursive);
+
+      const MIL_STRING& FolderName() const                 { return m_FolderName; }
+      MIL_INT NumberOfFiles() const                        { return (MIL_INT)m_Offsets.size(); }
+      const MIL_TEXT_CHAR* FileName(MIL_INT Index) const   { return &m_Chars[m_Offsets[(std::size_t)Index]]; }
+
+      // The subfolders found by a recursive scan, each one after its parent.
+      MIL_INT NumberOfSubFolders() const                   { return (MIL_INT)m_SubFolders.size(); }
+      const MIL_STRING& SubFolder(MIL_INT Index) const     { return m_SubFolders[(std::size_t)Index]; }
+
+   private:
+      MIL_STRING                 m_FolderName;
+      std::vector<MIL_STRING>    m_SubFolders;
+      std::vector<MIL_TEXT_CHAR> m_Chars;   // Null-terminated names, one after the other.
+      std::vector<std::size_t>   m_Offsets;
+   };
+
+bool HashFileStamp(const MIL_STRING& FileName, MIL_UINT64& Hash);
+
+MIL_UINT64 HashString(const MIL_STRING& Str, MIL_UINT64 Seed);
+
+MIL_UINT64 HashChars(const MIL_TEXT_CHAR* Str, std::size_t Length, MIL_UINT64 Seed);
+
+MIL_UINT64 HashBytes(const MIL_UINT8* Data, std::size_t Size, MIL_UINT64 Seed);
+
+MIL_UINT64 MixHash(MIL_UINT64 Hash);
+
+// Little-endian reads, for the zip, BMP and label cache structures.
+inline MIL_UINT16 ReadLe16(const MIL_UINT8* Data) { return (MIL_UINT16)(Data[0] | (Data[1] << 8)); }
+inline MIL_UINT32 ReadLe32(const MIL_UINT8* Data) { return (MIL_UINT32)ReadLe16(Data) | ((MIL_UINT32)ReadLe16(Data + 2) << 16); }
@@ -0,0 +1,167 @@
+﻿//*************************************************************************************
+//
+// File name: ZipArchive.cpp
+//
+// Synopsis:  Read-only access to the entries of a zip archive, decompressed in memory
+//            with zlib.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#include "ZipArchive.h"
+#include <zlib.h>
+#include <algorithm>
+
+bool CZipArchive::Open(const MIL_STRING& FileName)
+   {
+   static const MIL_UINT32 END_OF_CENTRAL_DIR_SIGNATURE = 0x06054b50;
+   static const MIL_UINT32 CENTRAL_DIR_SIGNATURE        = 0x02014b50;
+   static const std::size_t END_OF_CENTRAL_DIR_SIZE     = 22;
+   static const std::size_t CENTRAL_DIR_HEADER_SIZE     = 46;
+   static const MIL_UINT32 ZIP64_LOCATOR_SIGNATURE      = 0x07064b50;
+   static const std::size_t ZIP64_LOCATOR_SIZE          = 20;
+
+   m_Entries.clear();
+   if(!m_File.Open(FileName))
+      return false;
+
+   // Find the end of central directory record, that is followed by a comment
+   // of at most 64 KB.
+   const MIL_UINT8* Data = m_File.Data();
+   std::size_t Size = m_File.Size();
+   if(Size < END_OF_CENTRAL_DIR_SIZE)
+      return false;
+   std::size_t EndPos = Size - END_OF_CENTRAL_DIR_SIZE;
+   std::size_t MinEndPos = EndPos > 0xFFFF ? EndPos - 0xFFFF : 0;
+   while(ReadLe32(Data + EndPos) != END_OF_CENTRAL_DIR_SIGNATURE)
+      {
+      if(EndPos == MinEndPos)
+         return false;
+      EndPos--;
+      }
+
+   // A Zip64 archive has its own end of central directory, located by a
+   // record just before the regular one, whose fields are then saturated.
+   MIL_UINT16 NbEntries = ReadLe16(Data + EndPos + 10);
+   MIL_UINT32 DirSize   = ReadLe32(Data + EndPos + 12);
+   MIL_UINT32 DirOffset = ReadLe32(Data + EndPos + 16);
+   bool HasZip64Locator = EndPos >= ZIP64_LOCATOR_SIZE && ReadLe32(Data + EndPos - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_SIGNATURE;
+   if(HasZip64Locator || NbEntries == 0xFFFF || DirSize == 0xFFFFFFFF || DirOffset == 0xFFFFFFFF)
+      {
+      MosPrintf(MIL_TEXT("%s is a Zip64 archive, which is not supported.\n"), FileName.c_str());
+      return false;
+      }
+   if((std::size_t)DirOffset + DirSize > EndPos)
+      return false;
+
+   // Read the central directory.
+   m_Entries.reserve(NbEntries);
+   std::size_t Pos = DirOffset;
+   for(MIL_UINT16 i = 0; i < NbEntries; i++)
+      {
+      if(Pos + CENTRAL_DIR_HEADER_SIZE > EndPos || ReadLe32(Data + Pos) != CENTRAL_DIR_SIGNATURE)
+         return false;
+
+      const MIL_UINT8* Header = Data + Pos;
+      MIL_UINT16 NameLength    = ReadLe16(Header + 28);
+      MIL_UINT16 ExtraLength   = ReadLe16(Header + 30);
+      MIL_UINT16 CommentLength = ReadLe16(Header + 32);
+      if(Pos + CENTRAL_DIR_HEADER_SIZE + NameLength > EndPos)
+         return false;
+
+      SEntry Entry;
+      Entry.Flags             = ReadLe16(Header + 8);
+      Entry.Method            = ReadLe16(Header + 10);
+      Entry.Crc               = ReadLe32(Header + 16);
+      Entry.CompressedSize    = ReadLe32(Header + 20);
+      Entry.UncompressedSize  = ReadLe32(Header + 24);
+      Entry.LocalHeaderOffset = ReadLe32(Header + 42);
+
+      // The names are stored as bytes; they are widened as they are, which
+      // is exact for ASCII names.
+      const MIL_UINT8* Name = Header + CENTRAL_DIR_HEADER_SIZE;
+      Entry.Name.assign(Name, Name + NameLength);
+
+      // The sizes and the offset of a Zip64 entry are in its extra field.
+      if(Entry.CompressedSize == 0xFFFFFFFF || Entry.UncompressedSize == 0xFFFFFFFF || Entry.LocalHeaderOffset == 0xFFFFFFFF)
+         {
+         MosPrintf(MIL_TEXT("%s is a Zip64 entry, which is not supported.\n"), Entry.Name.c_str());
+         return false;
+         }
+
+      // Skip the folders.
+      if(!Entry.Name.empty() && Entry.Name.back() != MIL_TEXT('/'))
+         m_Entries.push_back(std::move(Entry));
+
+      Pos += CENTRAL_DIR_HEADER_SIZE + NameLength + ExtraLength + CommentLength;
+      }
+
+   std::sort(m_Entries.begin(), m_Entries.end(), [](const SEntry& A, const SEntry& B) { return A.Name < B.Name; });
+   return true;
+   }
+
+MIL_INT CZipArchive::FindEntry(const MIL_STRING& Name) const
+   {
+   auto It = std::lower_bound(m_Entries.begin(), m_Entries.end(), Name,
+                              [](const SEntry& Entry, const MIL_STRING& Value) { return Entry.Name < Value; });
+   if(It == m_Entries.end() || It->Name != Name)
+      return -1;
+   return (MIL_INT)(It - m_Entries.begin());
+   }
+
+bool CZipArchive::ReadEntry(MIL_INT Index, std::vector<MIL_UINT8>& Data) const
+   {
+   static const MIL_UINT32 LOCAL_HEADER_SIGNATURE = 0x04034b50;
+   static const std::size_t LOCAL_HEADER_SIZE     = 30;
+   static const MIL_UINT16 METHOD_STORED          = 0;
+   static const MIL_UINT16 METHOD_DEFLATED        = 8;
+
+   static const MIL_UINT16 FLAG_ENCRYPTED         = 0x0001;
+
+   const SEntry& Entry = m_Entries[(std::size_t)Index];
+   if(Entry.Flags & FLAG_ENCRYPTED)
+      {
+      MosPrintf(MIL_TEXT("%s is encrypted, which is not supported.\n"), Entry.Name.c_str());
+      return false;
+      }
+
+   // The local header can have an extra field different from the one of the
+   // central directory, so its own lengths locate the data.
+   const MIL_UINT8* FileData = m_File.Data();
+   std::size_t Pos = Entry.LocalHeaderOffset;
+   if(Pos + LOCAL_HEADER_SIZE > m_File.Size() || ReadLe32(FileData + Pos) != LOCAL_HEADER_SIGNATURE)
+      return false;
+   Pos += LOCAL_HEADER_SIZE + ReadLe16(FileData + Pos + 26) + ReadLe16(FileData + Pos + 28);
+   if(Pos + Entry.CompressedSize > m_File.Size())
+      return false;
+
+   const MIL_UINT8* Compressed = FileData + Pos;
+   Data.clear();
+   if(Entry.Method == METHOD_STORED)
+      Data.assign(Compressed, Compressed + Entry.CompressedSize);
+   else if(Entry.Method == METHOD_DEFLATED)
+      {
+      // The entries hold raw deflate streams, without the zlib header. zlib
+      // rejects a null output, which an empty entry would give.
+      Data.resize(Entry.UncompressedSize);
+      MIL_UINT8 EmptyOutput;
+      z_stream Stream = {};
+      if(inflateInit2(&Stream, -MAX_WBITS) != Z_OK)
+         return false;
+      Stream.next_in   = const_cast<Bytef*>(Compressed);
+      Stream.avail_in  = Entry.CompressedSize;
+      Stream.next_out  = Data.empty() ? &EmptyOutput : Data.data();
+      Stream.avail_out = Entry.UncompressedSize;
+      int Status = inflate(&Stream, Z_FINISH);
+      inflateEnd(&Stream);
+      if(Status != Z_STREAM_END || Stream.total_out != Entry.UncompressedSize)
+         return false;
+      }
+   else
+      {
+      MosPrintf(MIL_TEXT("%s uses the compression method %d, which is not supported.\n"), Entry.Name.c_str(), (int)Entry.Method);
+      return false;
+      }
+
+   return Data.size() == Entry.UncompressedSize && crc32(0, Data.data(), (uInt)Data.size()) == Entry.Crc;
+   }
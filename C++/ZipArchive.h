@@ -0,0 +1,49 @@
+﻿//*************************************************************************************
+//
+// File name: ZipArchive.h
+//
+// Synopsis:  Read-only access to the entries of a zip archive, decompressed in memory
+//            with zlib.
+//
+// Copyright © 1992-2024 Zebra Technologies Corp. and/or its affiliates
+// All Rights Reserved
+
+#pragma once
+
+#include "Utilities.h"
+
+// Zip archive read in place from its mapping. The entries can be stored or
+// deflated, and are decompressed in memory by zlib when they are read. Zip64
+// archives and encrypted entries are rejected with a message.
+class CZipArchive
+   {
+   public:
+      bool Open(const MIL_STRING& FileName);
+
+      MIL_INT NumberOfEntries() const                  { return (MIL_INT)m_Entries.size(); }
+      const MIL_STRING& EntryName(MIL_INT Index) const { return m_Entries[(std::size_t)Index].Name; }
+
+      // Returns the index of the entry with that name, or -1.
+      MIL_INT FindEntry(const MIL_STRING& Name) const;
+
+      // Decompresses an entry into Data and checks its CRC.
+      bool ReadEntry(MIL_INT Index, std::vector<MIL_UINT8>& Data) const;
+
+      MIL_UINT32 EntryCrc(MIL_INT Index) const  { return m_Entries[(std::size_t)Index].Crc; }
+      MIL_UINT32 EntrySize(MIL_INT Index) const { return m_Entries[(std::size_t)Index].UncompressedSize; }
+
+   private:
+      struct SEntry
+         {
+         MIL_STRING Name;
+         MIL_UINT16 Flags;
+         MIL_UINT16 Method;
+         MIL_UINT32 Crc;
+         MIL_UINT32 CompressedSize;
+         MIL_UINT32 UncompressedSize;
+         MIL_UINT32 LocalHeaderOffset;
+         };
+
+      CMappedFile          m_File;
+      std::vector<SEntry>  m_Entries;       // Sorted by name.
+   };